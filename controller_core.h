@@ -0,0 +1,303 @@
+// Hardware independent pieces of the controller: debounce, ADC protocol
+// encoding/decoding and the d-pad emulation. Shared by the kernel module and
+// the userspace uinput daemon, so nothing in here may call into the kernel or
+// libc.
+#ifndef CONTROLLER_CORE_H
+#define CONTROLLER_CORE_H
+
+#ifndef __KERNEL__
+#include <stdbool.h>
+#endif
+#include "dev_info.h"
+
+static inline int core_abs(int value) {
+    return value < 0 ? -value : value;
+}
+
+static inline unsigned int core_isqrt(unsigned int value) {
+    unsigned int root = 0, bit = 1u << 30;
+
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (bit) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+// An edge is accepted once the window since the last accepted edge has passed
+static inline bool core_debounce_accept(__u64 last_edge_ns, __u64 now_ns, __u64 window_ns) {
+    return now_ns - last_edge_ns > window_ns;
+}
+
+// val is the key value to report: 0 while released, counting up from 1 while
+// held, so a press edge on a key that is already down reports a repeat
+struct button_state {
+    __u64 last_edge_ns;
+    int val;
+};
+
+// Debounces one edge, taking the line level read for it rather than the edge
+// direction. Returns -1 if the edge is rejected, otherwise whether the key
+// went from released to pressed or back.
+static inline int core_button_edge(struct button_state *b, int level, __u64 now_ns, __u64 window_ns) {
+    bool was_pressed = b->val > 0;
+
+    if (!core_debounce_accept(b->last_edge_ns, now_ns, window_ns)) {
+        return -1;
+    }
+    b->last_edge_ns = now_ns;
+    if (level) {
+        b->val++;
+    } else {
+        b->val = 0;
+    }
+    return (b->val > 0) != was_pressed;
+}
+
+// Takes a level read outside any edge, at startup or resume. A key that stays
+// down keeps its val. Returns whether the key changed.
+static inline bool core_button_resync(struct button_state *b, int level) {
+    bool was_pressed = b->val > 0;
+
+    if (!level) {
+        b->val = 0;
+    } else if (!was_pressed) {
+        b->val = 1;
+    }
+    return (b->val > 0) != was_pressed;
+}
+
+// One half clock period of an ADC0832 frame: the CS/CLK/DOI levels, indexed
+// by ADC_LINE_*, and what to do around it
+struct adc_wave_step {
+    unsigned char lines;
+    unsigned char flags;
+};
+
+static inline int adc0832_wave_push(struct adc_wave_step *wave, int len, int cs, int clk, int doi, unsigned char flags) {
+    wave[len].lines = (cs << ADC_LINE_CS) | (clk << ADC_LINE_CLK) | (doi << ADC_LINE_DOI);
+    wave[len].flags = flags;
+    return len + 1;
+}
+
+// Builds the ADC0832 frame for one channel. The chip shifts the result out
+// MSB-first and then repeats it LSB-first, sharing bit 0; without verify CS
+// is raised right after the first byte, which the ADC0832 treats as an
+// aborted conversion.
+static inline int adc0832_build_waveform(struct adc_wave_step *wave, unsigned char channel, bool verify) {
+    int len = 0;
+    int bit;
+
+    // Start Sequence
+    len = adc0832_wave_push(wave, len, 0, 0, 1, 0);
+    len = adc0832_wave_push(wave, len, 0, 1, 1, 0);
+    len = adc0832_wave_push(wave, len, 0, 0, ADC0832_MUX_DIFFERENTIAL, 0);
+    len = adc0832_wave_push(wave, len, 0, 1, ADC0832_MUX_DIFFERENTIAL, 0);
+    // Send Sequence
+    len = adc0832_wave_push(wave, len, 0, 0, channel, 0);
+    len = adc0832_wave_push(wave, len, 0, 1, channel, 0);
+    // Receive Sequence
+    len = adc0832_wave_push(wave, len, 0, 0, 0, ADC_WAVE_RELEASE_DOI);
+    for (bit = 0; bit < 8; bit++) {
+        len = adc0832_wave_push(wave, len, 0, 1, 0, 0);
+        len = adc0832_wave_push(wave, len, 0, 0, 0, ADC_WAVE_SAMPLE_MSB);
+    }
+    if (verify) {
+        for (bit = 1; bit < 8; bit++) {
+            len = adc0832_wave_push(wave, len, 0, 1, 0, 0);
+            len = adc0832_wave_push(wave, len, 0, 0, 0, ADC_WAVE_SAMPLE_LSB);
+        }
+    }
+    // End Sequence
+    len = adc0832_wave_push(wave, len, 1, 0, 0, 0);
+    return len;
+}
+
+// Folds one DOI sample into the MSB-first or LSB-first accumulator
+static inline void adc0832_sample(unsigned char flags, int level, unsigned char *msb_first, unsigned char *lsb_first) {
+    if (flags & ADC_WAVE_SAMPLE_MSB) {
+        *msb_first = (*msb_first << 1) | level;
+    } else if (flags & ADC_WAVE_SAMPLE_LSB) {
+        *lsb_first = (*lsb_first >> 1) | (level << 7);
+    }
+}
+
+static inline bool adc0832_frame_ok(unsigned char msb_first, unsigned char lsb_first) {
+    // Bit 0 is shared between the two halves of the frame
+    return msb_first == ((lsb_first & 0xfe) | (msb_first & 0x01));
+}
+
+// When to clock a full, verified frame from an ADC that can check itself.
+// With fast_read every verify_interval-th sample is verified and the rest
+// read only the MSB-first byte; a fast sample that moves further than
+// jump_threshold (in 8 bit codes) from the last good one is read again with
+// verification.
+struct adc_verify_policy {
+    bool fast_read;
+    unsigned int verify_interval;
+    unsigned int jump_threshold;
+};
+
+static inline bool adc_verify_due(const struct adc_verify_policy *policy, unsigned long sample) {
+    return !policy->fast_read || policy->verify_interval <= 1 || sample % policy->verify_interval == 0;
+}
+
+static inline bool adc_sample_jumped(const struct adc_verify_policy *policy, unsigned char resolution,
+                                     const unsigned short *values, const unsigned short *last, int count) {
+    int jump = policy->jump_threshold << (resolution - 8);
+    int n;
+
+    for (n = 0; n < count; n++) {
+        if (core_abs((int)values[n] - (int)last[n]) > jump) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// MCP3008 and MCP3208 share a command format: start bit, single-ended bit and
+// a 3 bit channel, followed by a sample clock, a null bit and the result. The
+// command is aligned so the result ends on the last bit of a 3 byte frame.
+static inline void mcp3x08_command(unsigned char channel, unsigned char resolution, unsigned char *tx) {
+    __u32 cmd = (MCP3X08_START_SINGLE | channel) << (resolution + 2);
+
+    tx[0] = cmd >> 16;
+    tx[1] = cmd >> 8;
+    tx[2] = cmd;
+}
+
+static inline unsigned short mcp3x08_decode(const unsigned char *rx, unsigned char resolution) {
+    return ((rx[0] << 16) | (rx[1] << 8) | rx[2]) & ((1 << resolution) - 1);
+}
+
+enum {
+    DPAD_UP = 0,
+    DPAD_RIGHT,
+    DPAD_DOWN,
+    DPAD_LEFT,
+    DPAD_DIRECTION_COUNT
+};
+
+// Keys for each 45 degree sector, clockwise from straight up
+static const unsigned char dpad_sector_keys[8] = {
+    1 << DPAD_UP, (1 << DPAD_UP) | (1 << DPAD_RIGHT),
+    1 << DPAD_RIGHT, (1 << DPAD_RIGHT) | (1 << DPAD_DOWN),
+    1 << DPAD_DOWN, (1 << DPAD_DOWN) | (1 << DPAD_LEFT),
+    1 << DPAD_LEFT, (1 << DPAD_LEFT) | (1 << DPAD_UP)
+};
+
+// tan(0..45 degrees) in Q10
+static const unsigned short dpad_tan_q10[46] = {
+    0, 18, 36, 54, 72, 90, 108, 126, 144, 162, 181, 199, 218, 236, 255, 274,
+    294, 313, 333, 353, 373, 393, 414, 435, 456, 477, 499, 522, 544, 568, 591, 615,
+    640, 665, 691, 717, 744, 772, 800, 829, 859, 890, 922, 955, 989, 1024
+};
+
+struct dpad_config {
+    unsigned int press_threshold;
+    unsigned int release_threshold;
+    bool radial;
+    unsigned int angle_hysteresis;
+};
+
+struct dpad_state {
+    unsigned char keys;
+    unsigned char raw;
+    int sector;
+    unsigned long suppressed;
+};
+
+// Stick deflection from center in 8 bit units, whatever the chip resolution.
+// X high is up and Y low is right.
+static inline void dpad_position(unsigned short x, unsigned short y, unsigned char resolution, int *up, int *right) {
+    *up = (int)(x >> (resolution - 8)) - 128;
+    *right = 128 - (int)(y >> (resolution - 8));
+}
+
+// Angle of the stick clockwise from straight up, in whole degrees
+static inline int dpad_angle(int up, int right) {
+    int major = core_abs(up) > core_abs(right) ? core_abs(up) : core_abs(right);
+    int minor = core_abs(up) > core_abs(right) ? core_abs(right) : core_abs(up);
+    int deg = 0;
+    int angle;
+
+    while (deg < 45 && dpad_tan_q10[deg + 1] * major <= minor * 1024) {
+        deg++;
+    }
+    angle = core_abs(up) >= core_abs(right) ? deg : 90 - deg;
+    if (up >= 0) {
+        return right >= 0 ? angle : (360 - angle) % 360;
+    }
+    return right >= 0 ? 180 - angle : 180 + angle;
+}
+
+// Picks one of eight 45 degree sectors. A held sector is kept until the stick
+// moves angle_hysteresis degrees past its edge.
+static inline int dpad_sector(const struct dpad_config *config, int angle, bool held, int sector) {
+    int hysteresis = config->angle_hysteresis < 22 ? config->angle_hysteresis : 22;
+    int distance;
+
+    if (held) {
+        distance = core_abs(angle - sector * 45);
+        distance = distance < 360 - distance ? distance : 360 - distance;
+        if (distance <= 22 + hysteresis) {
+            return sector;
+        }
+    }
+    return ((angle + 22) / 45) % 8;
+}
+
+// Maps a stick position to a DPAD_* key bitmask. A key is pressed once the
+// deflection reaches press_threshold and released when it drops below
+// release_threshold. In radial mode the deflection is the stick radius and
+// the direction comes from dpad_sector(). Toggles a single threshold would
+// have reported but the hysteresis held back are counted in suppressed.
+static inline unsigned char dpad_update(const struct dpad_config *config, struct dpad_state *state, int up, int right) {
+    unsigned int press = config->press_threshold;
+    unsigned int release = config->release_threshold < press ? config->release_threshold : press;
+    int deflection[DPAD_DIRECTION_COUNT] = {up, right, -up, -right};
+    unsigned char keys = 0, raw = 0, changed;
+    unsigned int radius;
+    int angle, d;
+
+    if (config->radial) {
+        radius = core_isqrt(up * up + right * right);
+        angle = dpad_angle(up, right);
+        if (radius >= press) {
+            raw = dpad_sector_keys[dpad_sector(config, angle, false, 0)];
+        }
+        if (radius >= (state->keys ? release : press)) {
+            state->sector = dpad_sector(config, angle, state->keys != 0, state->sector);
+            keys = dpad_sector_keys[state->sector];
+        }
+    } else {
+        for (d = 0; d < DPAD_DIRECTION_COUNT; d++) {
+            if (deflection[d] >= (int)press) {
+                raw |= 1 << d;
+            }
+            if (deflection[d] >= (int)((state->keys & (1 << d)) ? release : press)) {
+                keys |= 1 << d;
+            }
+        }
+    }
+
+    changed = (raw ^ state->raw) & ~(keys ^ state->keys);
+    for (d = 0; d < DPAD_DIRECTION_COUNT; d++) {
+        if (changed & (1 << d)) {
+            state->suppressed++;
+        }
+    }
+    state->raw = raw;
+    state->keys = keys;
+    return keys;
+}
+
+#endif
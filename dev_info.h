@@ -1,11 +1,124 @@
+#ifndef DEV_INFO_H
+#define DEV_INFO_H
+
+#include <linux/types.h>
+#include <linux/input-event-codes.h>
+
+// Default wiring and keymap, overridable at load time
+#define LEFT_SHOULDER_PIN   26
+#define RIGHT_SHOULDER_PIN  17
+#define START_PIN           22
+#define SELECT_PIN          27
+#define A_PIN               12
+#define B_PIN               25
+#define X_PIN               24
+#define Y_PIN               23
+#define JOYSTICK_CS_PIN     18
+#define JOYSTICK_DOI_PIN    20
+#define JOYSTICK_CLK_PIN    21
+#define SPI_BUS_NUM         1
+#define SPI_IRQ_NUM         84 // ???
+
+#define LEFT_SHOULDER_KEY   KEY_GRAVE
+#define RIGHT_SHOULDER_KEY  KEY_1
+#define START_KEY           KEY_SPACE
+#define SELECT_KEY          KEY_ENTER
+#define A_KEY               KEY_C
+#define B_KEY               KEY_V
+#define X_KEY               KEY_Z
+#define Y_KEY               KEY_X
+#define UP_KEY              KEY_UP
+#define DOWN_KEY            KEY_DOWN
+#define LEFT_KEY            KEY_LEFT
+#define RIGHT_KEY           KEY_RIGHT
+
+enum {
+    LEFT_SHOULDER_BUTTON = 0,
+    RIGHT_SHOULDER_BUTTON,
+    START_BUTTON,
+    SELECT_BUTTON,
+    A_BUTTON,
+    B_BUTTON,
+    X_BUTTON,
+    Y_BUTTON,
+    BUTTON_COUNT
+};
+
+// Keymap slots after the buttons
+enum {
+    UP_KEYMAP = BUTTON_COUNT,
+    DOWN_KEYMAP,
+    LEFT_KEYMAP,
+    RIGHT_KEYMAP,
+    KEYMAP_SIZE
+};
+
+// Button debounce window, the same for the module and the daemon
+#define DEBOUNCE_NS         20000000ULL
+
 enum {
     ADC0832_MUX_SINGLE_ENDED = 0,
     ADC0832_MUX_DIFFERENTIAL = 1
 } adc0832mux_mode_t;
 
-#define ADC0832DELAY 2
+// The datasheet characterises the chip at 250 kHz; 400 kHz is the absolute max
+#define ADC0832_CLOCK_HZ     250000
+#define ADC0832_MIN_CLOCK_HZ 10000
+#define ADC0832_MAX_CLOCK_HZ 400000
+// 7 setup half periods, 16 MSB-first, 14 LSB-first and the CS release
+#define ADC0832_WAVE_MAX     38
+// Default ADC0832 verify policy, see struct adc_verify_policy
+#define ADC_VERIFY_INTERVAL  16
+#define ADC_JUMP_THRESHOLD   64
+
+#define MCP3008_SPI_HZ       1350000
+#define MCP3208_SPI_HZ       1000000
+#define MCP3X08_START_SINGLE 0x18
+#define MCP3X08_FRAME_LEN    3
+
+#define ADC_MAX_AUX_CHANNELS    4
+#define ADC_MAX_SAMPLE_CHANNELS (2 + ADC_MAX_AUX_CHANNELS)
+
+enum {
+    ADC_LINE_CS = 0,
+    ADC_LINE_CLK = 1,
+    ADC_LINE_DOI = 2,
+    ADC_LINE_COUNT = 3
+};
+
+enum {
+    ADC_WAVE_RELEASE_DOI = 0x01,
+    ADC_WAVE_SAMPLE_MSB = 0x02,
+    ADC_WAVE_SAMPLE_LSB = 0x04
+};
 
 enum {
     PS2JOYSTICK_X_AXIS = 0,
     PS2JOYSTICK_Y_AXIS = 1
-} ps2joystick_axis_t;
\ No newline at end of file
+} ps2joystick_axis_t;
+
+// Raw input trace format, in host byte order. Edge records carry the button index
+// and level. ADC records are one per conversion the backend clocked, with the
+// sample slot (X, Y, then aux channels) and the raw value: fast reads, verified
+// reads, and verified reads that failed the frame check (with the MSB-first
+// value). A read that failed on the bus leaves one ADC_ERROR record. All
+// records of one read share a timestamp.
+enum {
+    GPIO_TRACE_EDGE = 0,
+    GPIO_TRACE_ADC = 1,
+    GPIO_TRACE_ADC_VERIFIED = 2,
+    GPIO_TRACE_ADC_MISMATCH = 3,
+    GPIO_TRACE_ADC_ERROR = 4
+};
+
+struct gpio_trace_record {
+    __u64 ts_ns;
+    __u8 type;
+    __u8 line;
+    __u16 value;
+} __attribute__((packed));
+
+#define GPIO_TRACE_FIFO_LEN      4096
+#define GPIO_REPLAY_MAX_RECORDS  (1 << 16)
+
+#endif
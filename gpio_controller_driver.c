@@ -3,73 +3,239 @@
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
 #include <linux/jiffies.h>
 #include <linux/spi/spi.h>
 #include <linux/delay.h>
+#include <linux/sysfs.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/kfifo.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/hrtimer.h>
+#include <linux/platform_device.h>
+#include <linux/err.h>
+#include <linux/property.h>
+#include <linux/of.h>
+#include <linux/mod_devicetable.h>
+#include <linux/pm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include "dev_info.h"
+#include "controller_core.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Andrew Fox");
 MODULE_DESCRIPTION("A driver for a GPIO based custom RetroPie controller");
 MODULE_VERSION("0.4");
 
-#define LEFT_SHOULDER_PIN   26
-#define RIGHT_SHOULDER_PIN  17
-#define START_PIN           22
-#define SELECT_PIN          27
-#define A_PIN               12
-#define B_PIN               25
-#define X_PIN               24
-#define Y_PIN               23
-#define JOYSTICK_CS_PIN     18
-#define JOYSTICK_DOI_PIN    20
-#define JOYSTICK_CLK_PIN    21
-#define SPI_BUS_NUM         1
-#define SPI_IRQ_NUM         84 // ???
-
-#define LEFT_SHOULDER_KEY   KEY_GRAVE
-#define RIGHT_SHOULDER_KEY  KEY_1
-#define START_KEY           KEY_SPACE
-#define SELECT_KEY          KEY_ENTER
-#define A_KEY               KEY_C
-#define B_KEY               KEY_V
-#define X_KEY               KEY_Z
-#define Y_KEY               KEY_X
-#define UP_KEY              KEY_UP
-#define DOWN_KEY            KEY_DOWN
-#define LEFT_KEY            KEY_LEFT
-#define RIGHT_KEY           KEY_RIGHT
-
-#define DEBOUNCE_TIME       2
-
-extern unsigned long volatile jiffies;
+#define TURBO_MAX_RATE      100
+// Longest idle gap replay keeps from a trace, and the longest it sleeps
+// before checking for an abort
+#define REPLAY_MAX_GAP_MS   1000
+#define REPLAY_SLEEP_MAX_MS 10
+
+// Pins, keys and SPI placement. The dev_info.h #defines are only the defaults;
+// probe overlays device properties and then module parameters. Pins here are
+// global GPIO numbers and only used when the firmware node has no
+// button-gpios or joystick-gpios. The keymap is also the input device's
+// keycode table, so EVIOCSKEYCODE remaps keys live.
+struct controller_map {
+    unsigned int button_pins[BUTTON_COUNT];
+    unsigned int joystick_pins[ADC_LINE_COUNT];
+    unsigned short keymap[KEYMAP_SIZE];
+    int spi_bus;
+    int spi_chip_select;
+};
+
+static struct controller_map controller_map __read_mostly = {
+    .button_pins = {
+        LEFT_SHOULDER_PIN, RIGHT_SHOULDER_PIN, START_PIN, SELECT_PIN, A_PIN, B_PIN, X_PIN, Y_PIN
+    },
+    .joystick_pins = {
+        [ADC_LINE_CS] = JOYSTICK_CS_PIN,
+        [ADC_LINE_CLK] = JOYSTICK_CLK_PIN,
+        [ADC_LINE_DOI] = JOYSTICK_DOI_PIN
+    },
+    .keymap = {
+        LEFT_SHOULDER_KEY, RIGHT_SHOULDER_KEY, START_KEY, SELECT_KEY, A_KEY, B_KEY, X_KEY, Y_KEY,
+        UP_KEY, DOWN_KEY, LEFT_KEY, RIGHT_KEY
+    },
+    .spi_bus = SPI_BUS_NUM,
+    .spi_chip_select = 0
+};
+
+static unsigned int param_button_pins[BUTTON_COUNT];
+static int param_button_pins_count = 0;
+module_param_array_named(button_pins, param_button_pins, uint, &param_button_pins_count, 0444);
+MODULE_PARM_DESC(button_pins, "Global GPIO numbers for L, R, start, select, A, B, X, Y (overrides button-gpios)");
+static unsigned int param_joystick_pins[ADC_LINE_COUNT];
+static int param_joystick_pins_count = 0;
+module_param_array_named(joystick_pins, param_joystick_pins, uint, &param_joystick_pins_count, 0444);
+MODULE_PARM_DESC(joystick_pins, "ADC0832 bit-bang global GPIO numbers: CS, CLK, DOI (overrides joystick-gpios)");
+static unsigned int param_keymap[KEYMAP_SIZE];
+static int param_keymap_count = 0;
+module_param_array_named(keymap, param_keymap, uint, &param_keymap_count, 0444);
+MODULE_PARM_DESC(keymap, "Key codes for L, R, start, select, A, B, X, Y, up, down, left, right");
+static int param_spi_bus = -1;
+module_param_named(spi_bus, param_spi_bus, int, 0444);
+MODULE_PARM_DESC(spi_bus, "SPI bus of an MCP3x08 ADC (-1 for the default)");
+static int param_spi_chip_select = -1;
+module_param_named(spi_chip_select, param_spi_chip_select, int, 0444);
+MODULE_PARM_DESC(spi_chip_select, "SPI chip select of an MCP3x08 ADC (-1 for the default)");
 
 static struct input_polled_dev *gpio_polling_device;
 static struct input_dev *gpio_input_device;
-unsigned int left_shoulder_irq_number;
-unsigned int right_shoulder_irq_number;
-unsigned int start_irq_number;
-unsigned int select_irq_number;
-unsigned int a_irq_number;
-unsigned int b_irq_number;
-unsigned int x_irq_number;
-unsigned int y_irq_number;
-unsigned long old_left_shoulder_jiffie = 0;
-unsigned long old_right_shoulder_jiffie = 0;
-unsigned long old_start_jiffie = 0;
-unsigned long old_select_jiffie = 0;
-unsigned long old_a_jiffie = 0;
-unsigned long old_b_jiffie = 0;
-unsigned long old_x_jiffie = 0;
-unsigned long old_y_jiffie = 0;
-int left_shoulder_val = 0;
-int right_shoulder_val = 0;
-int start_val = 0;
-int select_val = 0;
-int a_val = 0;
-int b_val = 0;
-int x_val = 0;
-int y_val = 0;
+struct gpio_desc *button_descs[BUTTON_COUNT];
+unsigned int button_irqs[BUTTON_COUNT];
+
+// Everything the debounce and d-pad logic remembers between samples, so a
+// replayed trace can run through the same code without touching live state.
+// Only live_state has an input device; replay runs the logic and counts.
+struct controller_state {
+    struct input_dev *input;
+    struct button_state buttons[BUTTON_COUNT];
+    int left_key_val;
+    int right_key_val;
+    int down_key_val;
+    int up_key_val;
+    struct dpad_state dpad;
+    unsigned long events;
+    unsigned long debounce_rejects;
+    bool turbo;
+};
+
+static unsigned int dpad_press_threshold = 127;
+module_param(dpad_press_threshold, uint, 0644);
+MODULE_PARM_DESC(dpad_press_threshold, "Stick deflection from center (8 bit units) that presses a d-pad key");
+static unsigned int dpad_release_threshold = 96;
+module_param(dpad_release_threshold, uint, 0644);
+MODULE_PARM_DESC(dpad_release_threshold, "Stick deflection below which a held d-pad key is released");
+static bool dpad_radial = false;
+module_param(dpad_radial, bool, 0644);
+MODULE_PARM_DESC(dpad_radial, "Use the stick radius and 8 angular sectors instead of per axis thresholds");
+static unsigned int dpad_angle_hysteresis = 8;
+module_param(dpad_angle_hysteresis, uint, 0644);
+MODULE_PARM_DESC(dpad_angle_hysteresis, "Degrees past a sector edge before a held radial direction changes (max 22)");
+
+// Turbo buttons toggle their key at turbo_rate Hz while held, on for
+// turbo_duty percent of each period. One hrtimer serves every button.
+struct turbo_button {
+    bool held;
+    bool on;
+    ktime_t next;
+};
+
+struct turbo_button turbo_state[BUTTON_COUNT];
+struct hrtimer turbo_timer;
+static DEFINE_SPINLOCK(turbo_lock);
+unsigned int turbo_mask = 0;
+unsigned int turbo_rate = 10;
+unsigned int turbo_duty = 50;
+
+struct controller_state live_state = {
+    .turbo = true
+};
+struct controller_state replay_state;
+
+// Health counters for fleet monitoring, summed over CPUs when read from the
+// health/ directory under the input device. Only live input is counted.
+// axis_conversions counts conversions the backend actually clocked, re-reads
+// included; events counts key state changes reported, turbo toggles included,
+// but not repeats of a key that is already down.
+struct controller_stats {
+    unsigned long button_edges[BUTTON_COUNT];
+    unsigned long button_debounce_rejects[BUTTON_COUNT];
+    unsigned long button_presses[BUTTON_COUNT];
+    unsigned long axis_conversions[ADC_MAX_SAMPLE_CHANNELS];
+    unsigned long axis_mismatches[ADC_MAX_SAMPLE_CHANNELS];
+    unsigned long axis_out_of_range[ADC_MAX_SAMPLE_CHANNELS];
+    unsigned long polls;
+    unsigned long polls_skipped;
+    unsigned long events;
+    unsigned long syncs;
+};
+
+static struct controller_stats __percpu *controller_stats;
+u64 poll_last_ns = 0;
+
+#define controller_stat_inc(state, field) \
+    do { \
+        if ((state) == &live_state) { \
+            this_cpu_inc(controller_stats->field); \
+        } \
+    } while (0)
+
+static void controller_count_event(struct controller_state *state) {
+    state->events++;
+    controller_stat_inc(state, events);
+}
+
+static void controller_report_key(struct controller_state *state, unsigned int code, int value) {
+    if (state->input) {
+        input_report_key(state->input, code, value);
+    }
+}
+
+static void controller_report_abs(struct controller_state *state, unsigned int code, int value) {
+    if (state->input) {
+        input_report_abs(state->input, code, value);
+    }
+}
+
+static void controller_sync(struct controller_state *state) {
+    if (state->input) {
+        this_cpu_inc(controller_stats->syncs);
+        input_sync(state->input);
+    }
+}
+
+static bool trace_capture = false;
+module_param(trace_capture, bool, 0644);
+MODULE_PARM_DESC(trace_capture, "Capture raw edges and ADC frames to debugfs gpio_controller_driver/trace");
+
+struct replay_stats {
+    unsigned long records;
+    unsigned long skipped;
+    unsigned long edges;
+    unsigned long frames;
+    unsigned long adc_filtered;
+    unsigned long adc_failed;
+    u64 lag_total_ns;
+    u64 lag_max_ns;
+    u64 process_total_ns;
+    u64 process_max_ns;
+};
+
+static DEFINE_KFIFO(trace_fifo, struct gpio_trace_record, GPIO_TRACE_FIFO_LEN);
+static DEFINE_SPINLOCK(trace_lock);
+static atomic_long_t trace_dropped = ATOMIC_LONG_INIT(0);
+struct dentry *trace_dir;
+
+static void replay_work_fn(struct work_struct *work);
+static DECLARE_WORK(replay_work, replay_work_fn);
+struct gpio_trace_record *replay_buf;
+size_t replay_len;
+u32 replay_speed = 1;
+bool replay_abort;
+// Serialises the replay file against teardown, which sets replay_shutdown
+// before freeing replay_buf, and against suspend, which holds replays off
+// with replay_suspended until resume
+static DEFINE_MUTEX(replay_lock);
+bool replay_shutdown;
+bool replay_suspended;
+atomic_t replay_busy = ATOMIC_INIT(0);
+struct replay_stats replay_stats;
 
 struct spi_master *master;
 static struct spi_device *joystick_spi_dev;
@@ -81,468 +247,1447 @@ struct spi_board_info joystick_spi_dev_info = {
     .chip_select = 0,
     .mode = SPI_MODE_0
 };
-int left_key_val = 0;
-int right_key_val = 0;
-int down_key_val = 0;
-int up_key_val = 0;
-int i;
-
-bool gpio_device_allocated = false;
-bool gpio_device_registered = false;
-bool spi_device_registered = false;
-
-bool left_shoulder_pin_requested = false;
-bool right_shoulder_pin_requested = false;
-bool start_pin_requested = false;
-bool select_pin_requested = false;
-bool a_pin_requested = false;
-bool b_pin_requested = false;
-bool x_pin_requested = false;
-bool y_pin_requested = false;
-bool joystick_cs_pin_requested = false;
-bool joystick_clk_pin_requested = false;
-bool joystick_doi_pin_requested = false;
-
-bool left_shoulder_irq_set = false;
-bool right_shoulder_irq_set = false;
-bool start_irq_set = false;
-bool select_irq_set = false;
-bool a_irq_set = false;
-bool b_irq_set = false;
-bool x_irq_set = false;
-bool y_irq_set = false;
-
-static irqreturn_t left_shoulder_interrupt(int irq, void *dummy) {
-    static unsigned long flags;
-    local_irq_save(flags);
-    if (jiffies - old_left_shoulder_jiffie > DEBOUNCE_TIME) {
-        if (gpio_get_value(LEFT_SHOULDER_PIN)) {
-            left_shoulder_val++;
-        } else {
-            left_shoulder_val = 0;
-        }
-        input_report_key(gpio_input_device, LEFT_SHOULDER_KEY, left_shoulder_val);
-        input_sync(gpio_input_device);
-        old_left_shoulder_jiffie = jiffies;
+
+static struct adc_verify_policy adc_verify = {
+    .fast_read = true,
+    .verify_interval = ADC_VERIFY_INTERVAL,
+    .jump_threshold = ADC_JUMP_THRESHOLD
+};
+module_param_named(adc_fast_read, adc_verify.fast_read, bool, 0644);
+MODULE_PARM_DESC(adc_fast_read, "Read only the MSB-first byte of most ADC0832 conversions");
+module_param_named(adc_verify_interval, adc_verify.verify_interval, uint, 0644);
+MODULE_PARM_DESC(adc_verify_interval, "Clock a full verified ADC0832 frame every Nth sample");
+module_param_named(adc_jump_threshold, adc_verify.jump_threshold, uint, 0644);
+MODULE_PARM_DESC(adc_jump_threshold, "Re-read with verification when a fast sample moves further than this");
+
+static char *adc_chip_name = "adc0832";
+module_param_named(adc_chip, adc_chip_name, charp, 0444);
+MODULE_PARM_DESC(adc_chip, "ADC backend: adc0832, mcp3008, mcp3208 or none for buttons only");
+static unsigned int adc_spi_hz = 0;
+module_param(adc_spi_hz, uint, 0444);
+MODULE_PARM_DESC(adc_spi_hz, "Hardware SPI clock for the MCP3x08 backends (0 for the chip default)");
+static unsigned int adc_x_channel = PS2JOYSTICK_X_AXIS;
+module_param(adc_x_channel, uint, 0444);
+MODULE_PARM_DESC(adc_x_channel, "ADC channel wired to the stick X axis");
+static unsigned int adc_y_channel = PS2JOYSTICK_Y_AXIS;
+module_param(adc_y_channel, uint, 0444);
+MODULE_PARM_DESC(adc_y_channel, "ADC channel wired to the stick Y axis");
+static unsigned int adc_aux_channels[ADC_MAX_AUX_CHANNELS];
+static int adc_aux_count = 0;
+module_param_array(adc_aux_channels, uint, &adc_aux_count, 0444);
+MODULE_PARM_DESC(adc_aux_channels, "Extra ADC channels reported as ABS_RX, ABS_RY, ABS_Z and ABS_RZ");
+
+static unsigned int adc_clock_hz = ADC0832_CLOCK_HZ;
+module_param(adc_clock_hz, uint, 0444);
+MODULE_PARM_DESC(adc_clock_hz, "Target bit-bang clock rate for the ADC0832");
+
+struct gpio_desc *adc_descs[ADC_LINE_COUNT];
+struct adc_wave_step adc_wave[2][2][ADC0832_WAVE_MAX];
+int adc_wave_len[2][2];
+unsigned long adc_half_period_ns;
+// Half period delays with the measured cost of the GPIO calls taken out
+unsigned long adc_step_delay_ns;
+unsigned long adc_sample_delay_ns;
+
+// One backend per supported ADC. read() samples count channels in a single
+// transaction; verify is only meaningful for chips that set verifies. Only
+// needs_spi backends get an SPI device; the bit-banged ADC0832 drives the
+// same pins by hand and must not share them with an SPI master.
+struct adc_chip {
+    const char *name;
+    unsigned char resolution;
+    unsigned char num_channels;
+    unsigned int max_speed_hz;
+    bool bitbang;
+    bool needs_spi;
+    bool verifies;
+    int (*init)(struct device *dev);
+    int (*read)(const unsigned char *channels, int count, bool verify, unsigned short *values);
+};
+
+static const unsigned int aux_abs_codes[ADC_MAX_AUX_CHANNELS] = {ABS_RX, ABS_RY, ABS_Z, ABS_RZ};
+
+const struct adc_chip *adc_chip;
+unsigned char *adc_spi_buf;
+unsigned char adc_sample_channels[ADC_MAX_SAMPLE_CHANNELS];
+int adc_sample_count_channels;
+unsigned short adc_last_vals[ADC_MAX_SAMPLE_CHANNELS];
+u64 adc_busy_ns = 0;
+unsigned int adc_sample_count = 0;
+unsigned long adc_conversions = 0;
+unsigned long adc_verified = 0;
+unsigned long adc_mismatches = 0;
+unsigned long adc_read_errors = 0;
+
+s64 probe_time_us = 0;
+unsigned long resume_count = 0;
+s64 resume_latency_us = 0;
+s64 resume_latency_max_us = 0;
+
+static void trace_record(unsigned char type, unsigned char line, unsigned short value, u64 ts_ns) {
+    struct gpio_trace_record record = {
+        .ts_ns = ts_ns,
+        .type = type,
+        .line = line,
+        .value = value
+    };
+
+    if (trace_capture && kfifo_in_spinlocked(&trace_fifo, &record, 1, &trace_lock) == 0) {
+        atomic_long_inc(&trace_dropped);
     }
-    local_irq_restore(flags);
-    return IRQ_HANDLED;
 }
 
-static irqreturn_t right_shoulder_interrupt(int irq, void *dummy) {
-    static unsigned long flags;
-    local_irq_save(flags);
-    if (jiffies - old_right_shoulder_jiffie > DEBOUNCE_TIME) {
-        if (gpio_get_value(RIGHT_SHOULDER_PIN)) {
-            right_shoulder_val++;
-        } else {
-            right_shoulder_val = 0;
+static u64 turbo_phase_ns(bool on) {
+    u64 period_ns = div_u64(NSEC_PER_SEC, turbo_rate);
+    u64 on_ns = div_u64(period_ns * turbo_duty, 100);
+
+    return on ? on_ns : period_ns - on_ns;
+}
+
+// Caller holds turbo_lock
+static bool turbo_earliest(ktime_t *earliest) {
+    bool any = false;
+    int i;
+
+    for (i = 0; i < BUTTON_COUNT; i++) {
+        if (turbo_state[i].held && (!any || ktime_before(turbo_state[i].next, *earliest))) {
+            *earliest = turbo_state[i].next;
+            any = true;
         }
-        input_report_key(gpio_input_device, RIGHT_SHOULDER_KEY, right_shoulder_val);
-        input_sync(gpio_input_device);
-        old_right_shoulder_jiffie = jiffies;
     }
-    local_irq_restore(flags);
-    return IRQ_HANDLED;
+    return any;
 }
 
-static irqreturn_t start_interrupt(int irq, void *dummy) {
-    static unsigned long flags;
-    local_irq_save(flags);
-    if (jiffies - old_start_jiffie > DEBOUNCE_TIME) {
-        if (gpio_get_value(START_PIN)) {
-            start_val++;
-        } else {
-            start_val = 0;
+// Reports a live button edge, as turbo if the button is in turbo_mask and as
+// the plain val otherwise. The mask is tested under turbo_lock, so a button
+// that turbo_buttons_store() takes out of turbo can't be left held. Returns
+// whether the reported key changed: before the edge it showed the turbo phase
+// if the button was held in turbo, or the plain state it had otherwise. The
+// caller syncs.
+static bool turbo_button_edge(int button, int level, int val, bool was_pressed) {
+    struct turbo_button *t = &turbo_state[button];
+    unsigned long flags;
+    ktime_t earliest;
+    bool changed;
+
+    spin_lock_irqsave(&turbo_lock, flags);
+    if (!(turbo_mask & BIT(button))) {
+        t->held = false;
+        input_report_key(gpio_input_device, controller_map.keymap[button], val);
+        spin_unlock_irqrestore(&turbo_lock, flags);
+        return (val > 0) != was_pressed;
+    }
+    changed = (t->held ? t->on : was_pressed) != !!level;
+    t->held = level;
+    t->on = level;
+    input_report_key(gpio_input_device, controller_map.keymap[button], level);
+    if (level) {
+        t->next = ktime_add_ns(ktime_get(), turbo_phase_ns(true));
+        if (turbo_earliest(&earliest)) {
+            hrtimer_start(&turbo_timer, earliest, HRTIMER_MODE_ABS);
         }
-        input_report_key(gpio_input_device, START_KEY, start_val);
-        input_sync(gpio_input_device);
-        old_start_jiffie = jiffies;
     }
-    local_irq_restore(flags);
-    return IRQ_HANDLED;
+    spin_unlock_irqrestore(&turbo_lock, flags);
+    return changed;
 }
 
-static irqreturn_t select_interrupt(int irq, void *dummy) {
-    static unsigned long flags;
-    local_irq_save(flags);
-    if (jiffies - old_select_jiffie > DEBOUNCE_TIME) {
-        if (gpio_get_value(SELECT_PIN)) {
-            select_val++;
-        } else {
-            select_val = 0;
+// Toggles every held turbo button that is due and re-arms for the next one.
+// Phases are chained off the previous deadline so the rate doesn't drift. If
+// a button re-armed the timer while this ran, that arming already covers
+// every held button.
+static enum hrtimer_restart turbo_timer_fn(struct hrtimer *timer) {
+    struct turbo_button *t;
+    ktime_t now = ktime_get();
+    ktime_t earliest;
+    unsigned long flags;
+    bool sync = false, restart;
+    int i;
+
+    spin_lock_irqsave(&turbo_lock, flags);
+    for (i = 0; i < BUTTON_COUNT; i++) {
+        t = &turbo_state[i];
+        if (!t->held || ktime_after(t->next, now)) {
+            continue;
+        }
+        t->on = !t->on;
+        input_report_key(gpio_input_device, controller_map.keymap[i], t->on);
+        this_cpu_inc(controller_stats->events);
+        sync = true;
+        t->next = ktime_add_ns(t->next, turbo_phase_ns(t->on));
+        // Don't try to catch up on toggles missed while the timer was late
+        if (!ktime_after(t->next, now)) {
+            t->next = ktime_add_ns(now, turbo_phase_ns(t->on));
         }
-        input_report_key(gpio_input_device, SELECT_KEY, select_val);
-        input_sync(gpio_input_device);
-        old_select_jiffie = jiffies;
     }
+    if (sync) {
+        controller_sync(&live_state);
+    }
+    restart = !hrtimer_is_queued(timer) && turbo_earliest(&earliest);
+    if (restart) {
+        hrtimer_set_expires(timer, earliest);
+    }
+    spin_unlock_irqrestore(&turbo_lock, flags);
+    return restart ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+// Debounces one button edge and reports it. Shared by the IRQ handler and
+// trace replay.
+static void controller_button_edge(struct controller_state *state, int button, int level, u64 now_ns) {
+    struct button_state *b = &state->buttons[button];
+    bool was_pressed = b->val > 0;
+    int changed;
+
+    changed = core_button_edge(b, level, now_ns, DEBOUNCE_NS);
+    if (changed < 0) {
+        state->debounce_rejects++;
+        controller_stat_inc(state, button_debounce_rejects[button]);
+        return;
+    }
+    // A press edge on a key that is already down reports a repeat, not a press
+    if (level && !was_pressed) {
+        controller_stat_inc(state, button_presses[button]);
+    }
+    if (state->turbo) {
+        changed = turbo_button_edge(button, level, b->val, was_pressed);
+    } else {
+        controller_report_key(state, controller_map.keymap[button], b->val);
+    }
+    controller_sync(state);
+    if (changed) {
+        controller_count_event(state);
+    }
+}
+
+static irqreturn_t button_interrupt(int irq, void *dev_id) {
+    int button = (struct gpio_desc **)dev_id - button_descs;
+    unsigned long flags;
+    int level;
+    u64 now;
+
+    local_irq_save(flags);
+    now = ktime_get_ns();
+    level = gpiod_get_value(button_descs[button]);
+    this_cpu_inc(controller_stats->button_edges[button]);
+    trace_record(GPIO_TRACE_EDGE, button, level, now);
+    controller_button_edge(&live_state, button, level, now);
     local_irq_restore(flags);
     return IRQ_HANDLED;
 }
 
-static irqreturn_t a_interrupt(int irq, void *dummy) {
-    static unsigned long flags;
-    local_irq_save(flags);
-    if (jiffies - old_a_jiffie > DEBOUNCE_TIME) {
-        if (gpio_get_value(A_PIN)) {
-            a_val++;
+static void adc0832_build_waveforms(void) {
+    unsigned int clock_hz = clamp_t(unsigned int, adc_clock_hz, ADC0832_MIN_CLOCK_HZ, ADC0832_MAX_CLOCK_HZ);
+
+    adc_half_period_ns = DIV_ROUND_UP(NSEC_PER_SEC, 2 * clock_hz);
+    adc_wave_len[PS2JOYSTICK_X_AXIS][0] = adc0832_build_waveform(adc_wave[PS2JOYSTICK_X_AXIS][0], PS2JOYSTICK_X_AXIS, false);
+    adc_wave_len[PS2JOYSTICK_X_AXIS][1] = adc0832_build_waveform(adc_wave[PS2JOYSTICK_X_AXIS][1], PS2JOYSTICK_X_AXIS, true);
+    adc_wave_len[PS2JOYSTICK_Y_AXIS][0] = adc0832_build_waveform(adc_wave[PS2JOYSTICK_Y_AXIS][0], PS2JOYSTICK_Y_AXIS, false);
+    adc_wave_len[PS2JOYSTICK_Y_AXIS][1] = adc0832_build_waveform(adc_wave[PS2JOYSTICK_Y_AXIS][1], PS2JOYSTICK_Y_AXIS, true);
+}
+
+// Plays a precomputed frame. DOI is shared between the mux address and the
+// result, so it still changes direction twice per frame; everything else is
+// one gpiod_set_array_value call per half clock period.
+static int adc0832_read(unsigned char channel, bool verify, unsigned char *value) {
+    const struct adc_wave_step *wave = adc_wave[channel][verify];
+    int len = adc_wave_len[channel][verify];
+    unsigned char msb_first = 0, lsb_first = 0;
+    unsigned int lines = ADC_LINE_COUNT;
+    unsigned long bitmap;
+    int step;
+
+    gpiod_direction_output(adc_descs[ADC_LINE_DOI], 1);
+    for (step = 0; step < len; step++) {
+        if (wave[step].flags & ADC_WAVE_RELEASE_DOI) {
+            gpiod_direction_input(adc_descs[ADC_LINE_DOI]);
+            lines = ADC_LINE_DOI;
+        }
+        bitmap = wave[step].lines;
+        gpiod_set_array_value(lines, adc_descs, NULL, &bitmap);
+        if (wave[step].flags & (ADC_WAVE_SAMPLE_MSB | ADC_WAVE_SAMPLE_LSB)) {
+            ndelay(adc_sample_delay_ns);
+            adc0832_sample(wave[step].flags, gpiod_get_value(adc_descs[ADC_LINE_DOI]), &msb_first, &lsb_first);
         } else {
-            a_val = 0;
+            ndelay(adc_step_delay_ns);
         }
-        input_report_key(gpio_input_device, A_KEY, a_val);
-        input_sync(gpio_input_device);
-        old_a_jiffie = jiffies;
     }
-    local_irq_restore(flags);
-    return IRQ_HANDLED;
+
+    *value = msb_first;
+    if (verify && !adc0832_frame_ok(msb_first, lsb_first)) {
+        return -EIO;
+    }
+    return 0;
 }
 
-static irqreturn_t b_interrupt(int irq, void *dummy) {
-    static unsigned long flags;
-    local_irq_save(flags);
-    if (jiffies - old_b_jiffie > DEBOUNCE_TIME) {
-        if (gpio_get_value(B_PIN)) {
-            b_val++;
-        } else {
-            b_val = 0;
+static int adc0832_read_channels(const unsigned char *channels, int count, bool verify, unsigned short *values) {
+    u64 now = ktime_get_ns();
+    unsigned char value;
+    int n, err;
+
+    for (n = 0; n < count; n++) {
+        err = adc0832_read(channels[n], verify, &value);
+        // A frame that fails verification was still clocked
+        adc_conversions++;
+        this_cpu_inc(controller_stats->axis_conversions[n]);
+        if (err) {
+            this_cpu_inc(controller_stats->axis_mismatches[n]);
+            trace_record(GPIO_TRACE_ADC_MISMATCH, n, value, now);
+            return err;
         }
-        input_report_key(gpio_input_device, B_KEY, b_val);
-        input_sync(gpio_input_device);
-        old_b_jiffie = jiffies;
+        values[n] = value;
+        trace_record(verify ? GPIO_TRACE_ADC_VERIFIED : GPIO_TRACE_ADC, n, value, now);
     }
-    local_irq_restore(flags);
-    return IRQ_HANDLED;
+    return 0;
 }
 
-static irqreturn_t x_interrupt(int irq, void *dummy) {
-    static unsigned long flags;
-    local_irq_save(flags);
-    if (jiffies - old_x_jiffie > DEBOUNCE_TIME) {
-        if (gpio_get_value(X_PIN)) {
-            x_val++;
-        } else {
-            x_val = 0;
+// Times the GPIO calls a frame makes, with CS held high so the chip ignores
+// the clock, and takes them out of the half period delay. The fastest of a
+// few passes is used so an interrupt during calibration doesn't slow the
+// clock for good.
+static void adc0832_calibrate(struct device *dev) {
+    u64 set_ns = U64_MAX, get_ns = U64_MAX;
+    unsigned long bitmap;
+    u64 start;
+    int pass, step;
+
+    for (pass = 0; pass < 4; pass++) {
+        start = ktime_get_ns();
+        for (step = 0; step < ADC0832_WAVE_MAX; step++) {
+            bitmap = BIT(ADC_LINE_CS) | ((step & 1) << ADC_LINE_CLK);
+            gpiod_set_array_value(ADC_LINE_DOI, adc_descs, NULL, &bitmap);
         }
-        input_report_key(gpio_input_device, X_KEY, x_val);
-        input_sync(gpio_input_device);
-        old_x_jiffie = jiffies;
+        set_ns = min(set_ns, div_u64(ktime_get_ns() - start, ADC0832_WAVE_MAX));
+
+        start = ktime_get_ns();
+        for (step = 0; step < ADC0832_WAVE_MAX; step++) {
+            gpiod_get_value(adc_descs[ADC_LINE_DOI]);
+        }
+        get_ns = min(get_ns, div_u64(ktime_get_ns() - start, ADC0832_WAVE_MAX));
     }
-    local_irq_restore(flags);
-    return IRQ_HANDLED;
+    bitmap = BIT(ADC_LINE_CS);
+    gpiod_set_array_value(ADC_LINE_DOI, adc_descs, NULL, &bitmap);
+
+    adc_step_delay_ns = adc_half_period_ns > set_ns ? adc_half_period_ns - set_ns : 0;
+    adc_sample_delay_ns = adc_half_period_ns > set_ns + get_ns ? adc_half_period_ns - set_ns - get_ns : 0;
+    dev_info(dev, "ADC0832 half period %lu ns, GPIO set %llu ns, get %llu ns\n", adc_half_period_ns, set_ns, get_ns);
 }
 
-static irqreturn_t y_interrupt(int irq, void *dummy) {
-    static unsigned long flags;
-    local_irq_save(flags);
-    if (jiffies - old_y_jiffie > DEBOUNCE_TIME) {
-        if (gpio_get_value(Y_PIN)) {
-            y_val++;
-        } else {
-            y_val = 0;
+static int adc0832_init(struct device *dev) {
+    adc0832_build_waveforms();
+    adc0832_calibrate(dev);
+    return 0;
+}
+
+static int mcp3x08_read_channels(const unsigned char *channels, int count, bool verify, unsigned short *values) {
+    struct spi_transfer xfers[ADC_MAX_SAMPLE_CHANNELS];
+    unsigned char *tx, *rx;
+    u64 now;
+    int n, err;
+
+    memset(xfers, 0, sizeof(xfers));
+    for (n = 0; n < count; n++) {
+        tx = adc_spi_buf + n * MCP3X08_FRAME_LEN;
+        rx = adc_spi_buf + (ADC_MAX_SAMPLE_CHANNELS + n) * MCP3X08_FRAME_LEN;
+        mcp3x08_command(channels[n], adc_chip->resolution, tx);
+        xfers[n].tx_buf = tx;
+        xfers[n].rx_buf = rx;
+        xfers[n].len = MCP3X08_FRAME_LEN;
+        xfers[n].cs_change = n < count - 1;
+    }
+    err = spi_sync_transfer(joystick_spi_dev, xfers, count);
+    now = ktime_get_ns();
+    if (err) {
+        trace_record(GPIO_TRACE_ADC_ERROR, 0, 0, now);
+        return err;
+    }
+    for (n = 0; n < count; n++) {
+        rx = adc_spi_buf + (ADC_MAX_SAMPLE_CHANNELS + n) * MCP3X08_FRAME_LEN;
+        values[n] = mcp3x08_decode(rx, adc_chip->resolution);
+        adc_conversions++;
+        this_cpu_inc(controller_stats->axis_conversions[n]);
+        trace_record(GPIO_TRACE_ADC, n, values[n], now);
+    }
+    return 0;
+}
+
+static int mcp3x08_init(struct device *dev) {
+    // SPI buffers have to be DMA safe, so they can't live in module data
+    adc_spi_buf = devm_kzalloc(dev, 2 * ADC_MAX_SAMPLE_CHANNELS * MCP3X08_FRAME_LEN, GFP_KERNEL);
+    return adc_spi_buf ? 0 : -ENOMEM;
+}
+
+static const struct adc_chip adc_chips[] = {
+    {
+        .name = "adc0832",
+        .resolution = 8,
+        .num_channels = 2,
+        .max_speed_hz = ADC0832_MAX_CLOCK_HZ,
+        .bitbang = true,
+        .verifies = true,
+        .init = adc0832_init,
+        .read = adc0832_read_channels
+    },
+    {
+        .name = "mcp3008",
+        .resolution = 10,
+        .num_channels = 8,
+        .max_speed_hz = MCP3008_SPI_HZ,
+        .needs_spi = true,
+        .init = mcp3x08_init,
+        .read = mcp3x08_read_channels
+    },
+    {
+        .name = "mcp3208",
+        .resolution = 12,
+        .num_channels = 8,
+        .max_speed_hz = MCP3208_SPI_HZ,
+        .needs_spi = true,
+        .init = mcp3x08_init,
+        .read = mcp3x08_read_channels
+    },
+    {
+        // Buttons only, e.g. on a gpio-sim chip with no SPI master behind it
+        .name = "none",
+        .resolution = 8
+    }
+};
+
+// Samples the stick and any aux channels in one transaction. Chips that can
+// verify (the ADC0832) follow adc_verify, the same policy the userspace
+// daemon applies.
+static int joystick_sample(void) {
+    unsigned short values[ADC_MAX_SAMPLE_CHANNELS];
+    bool verify = adc_chip->verifies && adc_verify_due(&adc_verify, adc_sample_count);
+    u64 start;
+    int err, n;
+
+    if (adc_chip->read == NULL) {
+        return -ENODEV;
+    }
+    start = ktime_get_ns();
+    err = adc_chip->read(adc_sample_channels, adc_sample_count_channels, verify, values);
+    if (err == 0 && adc_chip->verifies && !verify &&
+        adc_sample_jumped(&adc_verify, adc_chip->resolution, values, adc_last_vals, adc_sample_count_channels)) {
+        verify = true;
+        err = adc_chip->read(adc_sample_channels, adc_sample_count_channels, true, values);
+    }
+    adc_busy_ns += ktime_get_ns() - start;
+    if (verify) {
+        adc_verified++;
+    }
+    // Only a verified frame can mismatch; anything else is the bus failing
+    if (err == -EIO && verify) {
+        adc_mismatches++;
+    } else if (err) {
+        adc_read_errors++;
+    }
+    if (err) {
+        return err;
+    }
+    // Rail codes: a stick at full travel hits them briefly, a broken pot or
+    // an open ground/VCC wire sits there
+    for (n = 0; n < adc_sample_count_channels; n++) {
+        if (values[n] == 0 || values[n] == (1 << adc_chip->resolution) - 1) {
+            this_cpu_inc(controller_stats->axis_out_of_range[n]);
         }
-        input_report_key(gpio_input_device, Y_KEY, y_val);
-        input_sync(gpio_input_device);
-        old_y_jiffie = jiffies;
     }
-    local_irq_restore(flags);
-    return IRQ_HANDLED;
+    memcpy(adc_last_vals, values, sizeof(values[0]) * adc_sample_count_channels);
+    return 0;
+}
+
+static void controller_dpad_key(struct controller_state *state, unsigned int key, int *val, bool pressed) {
+    if (pressed != (*val > 0)) {
+        controller_count_event(state);
+    }
+    if (pressed) {
+        (*val)++;
+    } else {
+        *val = 0;
+    }
+    controller_report_key(state, key, *val);
+}
+
+// Turns one set of conversions into aux axis and d-pad reports. Shared by the
+// poll, resume and trace replay; the caller syncs, so resume can send buttons
+// and stick as one frame.
+static void controller_adc_frame(struct controller_state *state, const unsigned short *values) {
+    struct dpad_config config = {
+        .press_threshold = dpad_press_threshold,
+        .release_threshold = dpad_release_threshold,
+        .radial = dpad_radial,
+        .angle_hysteresis = dpad_angle_hysteresis
+    };
+    unsigned char keys;
+    int up, right, n;
+
+    for (n = 0; n < adc_aux_count; n++) {
+        controller_report_abs(state, aux_abs_codes[n], values[2 + n]);
+    }
+
+    dpad_position(values[0], values[1], adc_chip->resolution, &up, &right);
+    keys = dpad_update(&config, &state->dpad, up, right);
+
+    controller_dpad_key(state, controller_map.keymap[LEFT_KEYMAP], &state->left_key_val, keys & BIT(DPAD_LEFT));
+    controller_dpad_key(state, controller_map.keymap[RIGHT_KEYMAP], &state->right_key_val, keys & BIT(DPAD_RIGHT));
+    controller_dpad_key(state, controller_map.keymap[DOWN_KEYMAP], &state->down_key_val, keys & BIT(DPAD_DOWN));
+    controller_dpad_key(state, controller_map.keymap[UP_KEYMAP], &state->up_key_val, keys & BIT(DPAD_UP));
 }
 
+// A poll is skipped when its sample fails, and for every whole interval the
+// poll work ran late by
 static void joystick_spi_poll(struct input_polled_dev *dev) {
-    unsigned char x1, x2, y1, y2;
-
-    gpio_set_value(JOYSTICK_CS_PIN, 0);
-    // Start Sequence
-    gpio_set_value(JOYSTICK_CLK_PIN, 0);
-    gpio_direction_output(JOYSTICK_DOI_PIN, 1);
-    udelay(ADC0832DELAY);
-    gpio_set_value(JOYSTICK_CLK_PIN, 1);
-    udelay(ADC0832DELAY);
-    gpio_set_value(JOYSTICK_CLK_PIN, 0);
-    gpio_set_value(JOYSTICK_DOI_PIN, ADC0832_MUX_DIFFERENTIAL);
-    udelay(ADC0832DELAY);
-    gpio_set_value(JOYSTICK_CLK_PIN, 1);
-    udelay(ADC0832DELAY);
-    // Send Sequence
-    gpio_set_value(JOYSTICK_CLK_PIN, 0);
-    gpio_set_value(JOYSTICK_DOI_PIN, PS2JOYSTICK_X_AXIS);
-    udelay(ADC0832DELAY);
-    gpio_set_value(JOYSTICK_CLK_PIN, 1);
-    gpio_set_value(JOYSTICK_DOI_PIN, 1);
-    udelay(ADC0832DELAY);
-    // Receive Sequence
-    gpio_set_value(JOYSTICK_CLK_PIN, 0);
-    gpio_set_value(JOYSTICK_DOI_PIN, 1);
-    udelay(ADC0832DELAY);
-    gpio_direction_input(JOYSTICK_DOI_PIN);
-    for (i = 0; i < 8; i++) {
-        gpio_set_value(JOYSTICK_CLK_PIN, 1);
-        udelay(ADC0832DELAY);
-        gpio_set_value(JOYSTICK_CLK_PIN, 0);
-        udelay(ADC0832DELAY);
-        x1 = (x1 << 1) | gpio_get_value(JOYSTICK_DOI_PIN);
-    }
-    for (i = 0; i < 8; i++) {
-        x2 = x2 | (gpio_get_value(JOYSTICK_DOI_PIN) << i);
-        gpio_set_value(JOYSTICK_CLK_PIN, 1);
-        udelay(ADC0832DELAY);
-        gpio_set_value(JOYSTICK_CLK_PIN, 0);
-        udelay(ADC0832DELAY);
-    }
-    // Reset Sequence
-    gpio_set_value(JOYSTICK_CS_PIN, 1);
-    udelay(ADC0832DELAY);
-    gpio_set_value(JOYSTICK_CS_PIN, 0);
-    // Start Sequence
-    gpio_set_value(JOYSTICK_CLK_PIN, 0);
-    gpio_direction_output(JOYSTICK_DOI_PIN, 1);
-    udelay(ADC0832DELAY);
-    gpio_set_value(JOYSTICK_CLK_PIN, 1);
-    udelay(ADC0832DELAY);
-    gpio_set_value(JOYSTICK_CLK_PIN, 0);
-    gpio_set_value(JOYSTICK_DOI_PIN, ADC0832_MUX_DIFFERENTIAL);
-    udelay(ADC0832DELAY);
-    gpio_set_value(JOYSTICK_CLK_PIN, 1);
-    udelay(ADC0832DELAY);
-    // Send Sequence
-    gpio_set_value(JOYSTICK_CLK_PIN, 0);
-    gpio_set_value(JOYSTICK_DOI_PIN, PS2JOYSTICK_Y_AXIS);
-    udelay(ADC0832DELAY);
-    gpio_set_value(JOYSTICK_CLK_PIN, 1);
-    gpio_set_value(JOYSTICK_DOI_PIN, 1);
-    udelay(ADC0832DELAY);
-    // Receive Sequence
-    gpio_set_value(JOYSTICK_CLK_PIN, 0);
-    gpio_set_value(JOYSTICK_DOI_PIN, 1);
-    udelay(ADC0832DELAY);
-    gpio_direction_input(JOYSTICK_DOI_PIN);
-    for (i = 0; i < 8; i++) {
-        gpio_set_value(JOYSTICK_CLK_PIN, 1);
-        udelay(ADC0832DELAY);
-        gpio_set_value(JOYSTICK_CLK_PIN, 0);
-        udelay(ADC0832DELAY);
-        y1 = (y1 << 1) | gpio_get_value(JOYSTICK_DOI_PIN);
-    }
-    for (i = 0; i < 8; i++) {
-        y2 = y2 | (gpio_get_value(JOYSTICK_DOI_PIN) << i);
-        gpio_set_value(JOYSTICK_CLK_PIN, 1);
-        udelay(ADC0832DELAY);
-        gpio_set_value(JOYSTICK_CLK_PIN, 0);
-        udelay(ADC0832DELAY);
-    }
-    // End Sequence
-    gpio_set_value(JOYSTICK_CS_PIN, 1);
-
-    if (x1 == x2 && y1 == y2) {
-        if (x1 < 2) {
-            down_key_val++;
-        } else {
-            down_key_val = 0;
+    u64 now = ktime_get_ns();
+    u64 interval = (u64)dev->poll_interval * NSEC_PER_MSEC;
+
+    if (adc_chip->read == NULL) {
+        return;
+    }
+    this_cpu_inc(controller_stats->polls);
+    if (poll_last_ns && interval && now - poll_last_ns >= 2 * interval) {
+        this_cpu_add(controller_stats->polls_skipped, div64_u64(now - poll_last_ns, interval) - 1);
+    }
+    poll_last_ns = now;
+
+    adc_sample_count++;
+    if (joystick_sample() == 0) {
+        controller_adc_frame(&live_state, adc_last_vals);
+        controller_sync(&live_state);
+    } else {
+        this_cpu_inc(controller_stats->polls_skipped);
+    }
+}
+
+// Polling only runs while the device is open, don't count the closed time
+static void joystick_spi_open(struct input_polled_dev *dev) {
+    poll_last_ns = 0;
+}
+
+// Mirrors joystick_sample() on the raw reads in a trace: a failed read reports
+// nothing, a verified one is reported, and a fast one that jumps under
+// adc_verify is dropped in favour of the verified re-read that follows it.
+static void replay_adc_record(const struct gpio_trace_record *record, unsigned short *values, unsigned short *last) {
+    int count = adc_sample_count_channels;
+
+    if (record->type == GPIO_TRACE_ADC_MISMATCH || record->type == GPIO_TRACE_ADC_ERROR) {
+        replay_stats.adc_failed++;
+        return;
+    }
+    values[record->line] = record->value;
+    // A read is complete once its last channel has been seen
+    if (record->line != count - 1) {
+        return;
+    }
+    if (record->type == GPIO_TRACE_ADC && adc_chip->verifies &&
+        adc_sample_jumped(&adc_verify, adc_chip->resolution, values, last, count)) {
+        replay_stats.adc_filtered++;
+        return;
+    }
+    memcpy(last, values, sizeof(*values) * count);
+    controller_adc_frame(&replay_state, values);
+    controller_sync(&replay_state);
+    replay_stats.frames++;
+}
+
+// Sleeps until due in short chunks, so suspend and teardown never wait on a
+// long gap in the trace
+static void replay_wait(u64 due) {
+    u64 now = ktime_get_ns();
+    unsigned long us;
+
+    while (due > now && !READ_ONCE(replay_abort)) {
+        us = div_u64(min_t(u64, due - now, REPLAY_SLEEP_MAX_MS * NSEC_PER_MSEC), NSEC_PER_USEC);
+        usleep_range(us, us + 50);
+        now = ktime_get_ns();
+    }
+}
+
+// Replays a trace written to debugfs through the same debounce, ADC verify
+// and d-pad code as live input, at the original pace divided by replay_speed
+// (0 replays as fast as possible). Timestamps that go backwards, e.g. records
+// from two CPUs or concatenated traces, are taken as no gap, and idle gaps are
+// cut to REPLAY_MAX_GAP_MS. Replay uses its own controller_state with no input
+// device, so nothing reaches userspace; the outcome is in replay_stats.
+static void replay_work_fn(struct work_struct *work) {
+    unsigned short values[ADC_MAX_SAMPLE_CHANNELS], last[ADC_MAX_SAMPLE_CHANNELS];
+    const struct gpio_trace_record *record;
+    u64 start, ts, elapsed, due, now, lag, spent;
+    size_t n;
+
+    memset(&replay_state, 0, sizeof(replay_state));
+    memset(&replay_stats, 0, sizeof(replay_stats));
+    memcpy(values, adc_last_vals, sizeof(values));
+    memcpy(last, adc_last_vals, sizeof(last));
+    ts = replay_len ? replay_buf[0].ts_ns : 0;
+    elapsed = 0;
+    start = ktime_get_ns();
+    for (n = 0; n < replay_len && !READ_ONCE(replay_abort); n++) {
+        record = &replay_buf[n];
+        if (record->ts_ns > ts) {
+            elapsed += min_t(u64, record->ts_ns - ts, REPLAY_MAX_GAP_MS * NSEC_PER_MSEC);
+            ts = record->ts_ns;
         }
-        if (x1 > 254) {
-            up_key_val++;
-        } else {
-            up_key_val = 0;
+        now = ktime_get_ns();
+        if (replay_speed) {
+            due = start + div_u64(elapsed, replay_speed);
+            if (due > now) {
+                replay_wait(due);
+                now = ktime_get_ns();
+            }
+            lag = now > due ? now - due : 0;
+            replay_stats.lag_total_ns += lag;
+            replay_stats.lag_max_ns = max(replay_stats.lag_max_ns, lag);
         }
-        if (y1 < 2) {
-            right_key_val++;
+
+        if (record->type == GPIO_TRACE_EDGE && record->line < BUTTON_COUNT) {
+            controller_button_edge(&replay_state, record->line, record->value, ts);
+            replay_stats.edges++;
+        } else if (record->type >= GPIO_TRACE_ADC && record->type <= GPIO_TRACE_ADC_ERROR &&
+                   record->line < adc_sample_count_channels) {
+            replay_adc_record(record, values, last);
         } else {
-            right_key_val = 0;
+            replay_stats.skipped++;
+            continue;
         }
-        if (y1 > 254) {
-            left_key_val++;
+        spent = ktime_get_ns() - now;
+        replay_stats.process_total_ns += spent;
+        replay_stats.process_max_ns = max(replay_stats.process_max_ns, spent);
+        replay_stats.records++;
+    }
+    atomic_set(&replay_busy, 0);
+}
+
+static ssize_t trace_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    unsigned int copied;
+    int err;
+
+    // Only whole records are handed out
+    count -= count % sizeof(struct gpio_trace_record);
+    err = kfifo_to_user(&trace_fifo, buf, count, &copied);
+    return err ? err : copied;
+}
+
+static const struct file_operations trace_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = trace_read,
+    .llseek = no_llseek
+};
+
+static int replay_open(struct inode *inode, struct file *file) {
+    int err = 0;
+
+    mutex_lock(&replay_lock);
+    if (replay_shutdown) {
+        err = -ENODEV;
+    } else if (replay_suspended) {
+        err = -EBUSY;
+    } else if (atomic_cmpxchg(&replay_busy, 0, 1) != 0) {
+        err = -EBUSY;
+    } else if (replay_buf == NULL) {
+        replay_buf = vmalloc(array_size(GPIO_REPLAY_MAX_RECORDS, sizeof(*replay_buf)));
+        if (replay_buf == NULL) {
+            atomic_set(&replay_busy, 0);
+            err = -ENOMEM;
+        }
+    }
+    if (err == 0) {
+        replay_len = 0;
+    }
+    mutex_unlock(&replay_lock);
+    return err;
+}
+
+static ssize_t replay_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    size_t limit = GPIO_REPLAY_MAX_RECORDS * sizeof(*replay_buf);
+    ssize_t ret = count;
+
+    if (*ppos >= limit) {
+        return -EFBIG;
+    }
+    count = min_t(size_t, count, limit - *ppos);
+    mutex_lock(&replay_lock);
+    if (replay_shutdown) {
+        ret = -ENODEV;
+    } else if (copy_from_user((char *)replay_buf + *ppos, buf, count)) {
+        ret = -EFAULT;
+    } else {
+        *ppos += count;
+        replay_len = *ppos / sizeof(*replay_buf);
+        ret = count;
+    }
+    mutex_unlock(&replay_lock);
+    return ret;
+}
+
+// Closing the file starts the replay; replay_busy is cleared when it ends.
+// After teardown or while suspended the file can still be closed, but nothing
+// is queued.
+static int replay_release(struct inode *inode, struct file *file) {
+    mutex_lock(&replay_lock);
+    if (replay_len == 0 || replay_shutdown || replay_suspended) {
+        atomic_set(&replay_busy, 0);
+    } else {
+        replay_abort = false;
+        queue_work(system_long_wq, &replay_work);
+    }
+    mutex_unlock(&replay_lock);
+    return 0;
+}
+
+static const struct file_operations replay_fops = {
+    .owner = THIS_MODULE,
+    .open = replay_open,
+    .write = replay_write,
+    .release = replay_release
+};
+
+static int replay_stats_show(struct seq_file *m, void *v) {
+    seq_printf(m, "running: %d\n", atomic_read(&replay_busy));
+    seq_printf(m, "records: %lu\n", replay_stats.records);
+    seq_printf(m, "skipped: %lu\n", replay_stats.skipped);
+    seq_printf(m, "edges: %lu\n", replay_stats.edges);
+    seq_printf(m, "adc_frames: %lu\n", replay_stats.frames);
+    seq_printf(m, "adc_filtered: %lu\n", replay_stats.adc_filtered);
+    seq_printf(m, "adc_failed: %lu\n", replay_stats.adc_failed);
+    seq_printf(m, "events: %lu\n", replay_state.events);
+    seq_printf(m, "debounce_rejects: %lu\n", replay_state.debounce_rejects);
+    seq_printf(m, "dpad_suppressed: %lu\n", replay_state.dpad.suppressed);
+    seq_printf(m, "lag_avg_ns: %llu\n", replay_stats.records ? div_u64(replay_stats.lag_total_ns, replay_stats.records) : 0);
+    seq_printf(m, "lag_max_ns: %llu\n", replay_stats.lag_max_ns);
+    seq_printf(m, "process_avg_ns: %llu\n", replay_stats.records ? div_u64(replay_stats.process_total_ns, replay_stats.records) : 0);
+    seq_printf(m, "process_max_ns: %llu\n", replay_stats.process_max_ns);
+    seq_printf(m, "live_events: %lu\n", live_state.events);
+    seq_printf(m, "live_debounce_rejects: %lu\n", live_state.debounce_rejects);
+    seq_printf(m, "trace_dropped: %ld\n", atomic_long_read(&trace_dropped));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(replay_stats);
+
+static void trace_debugfs_init(void) {
+    replay_shutdown = false;
+    trace_dir = debugfs_create_dir("gpio_controller_driver", NULL);
+    debugfs_create_file("trace", 0400, trace_dir, NULL, &trace_fops);
+    debugfs_create_file("replay", 0200, trace_dir, NULL, &replay_fops);
+    debugfs_create_file("replay_stats", 0400, trace_dir, NULL, &replay_stats_fops);
+    debugfs_create_u32("replay_speed", 0600, trace_dir, &replay_speed);
+}
+
+static void trace_debugfs_exit(void *data) {
+    debugfs_remove_recursive(trace_dir);
+    trace_dir = NULL;
+    mutex_lock(&replay_lock);
+    replay_shutdown = true;
+    replay_abort = true;
+    mutex_unlock(&replay_lock);
+    cancel_work_sync(&replay_work);
+    vfree(replay_buf);
+    replay_buf = NULL;
+}
+
+static ssize_t adc_conversions_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%lu\n", adc_conversions);
+}
+static DEVICE_ATTR_RO(adc_conversions);
+
+static ssize_t adc_verified_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%lu\n", adc_verified);
+}
+static DEVICE_ATTR_RO(adc_verified);
+
+static ssize_t adc_mismatches_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%lu\n", adc_mismatches);
+}
+static DEVICE_ATTR_RO(adc_mismatches);
+
+static ssize_t adc_read_errors_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%lu\n", adc_read_errors);
+}
+static DEVICE_ATTR_RO(adc_read_errors);
+
+// Mismatches per million verified frames
+static ssize_t adc_mismatch_ppm_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    unsigned long verified = adc_verified;
+
+    return sprintf(buf, "%llu\n", verified ? div_u64((u64)adc_mismatches * 1000000, verified) : 0);
+}
+static DEVICE_ATTR_RO(adc_mismatch_ppm);
+
+static ssize_t adc_chip_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%s\n", adc_chip->name);
+}
+static DEVICE_ATTR_RO(adc_chip);
+
+// Conversions per second of bus time, for comparing backends
+static ssize_t adc_sample_rate_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    u64 busy_ns = adc_busy_ns;
+
+    return sprintf(buf, "%llu\n", busy_ns ? div64_u64((u64)adc_conversions * NSEC_PER_SEC, busy_ns) : 0);
+}
+static DEVICE_ATTR_RO(adc_sample_rate);
+
+static ssize_t dpad_suppressed_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%lu\n", live_state.dpad.suppressed);
+}
+static DEVICE_ATTR_RO(dpad_suppressed);
+
+static ssize_t turbo_buttons_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "0x%02x\n", turbo_mask);
+}
+
+// Takes a bitmask of button indices. Buttons taken out of turbo while held
+// go back to reporting a plain press.
+static ssize_t turbo_buttons_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned long flags;
+    unsigned int mask;
+    bool sync = false;
+    int err, i;
+
+    err = kstrtouint(buf, 0, &mask);
+    if (err) {
+        return err;
+    }
+    if (mask & ~(BIT(BUTTON_COUNT) - 1)) {
+        return -EINVAL;
+    }
+
+    spin_lock_irqsave(&turbo_lock, flags);
+    for (i = 0; i < BUTTON_COUNT; i++) {
+        if (turbo_state[i].held && !(mask & BIT(i))) {
+            turbo_state[i].held = false;
+            if (!turbo_state[i].on) {
+                this_cpu_inc(controller_stats->events);
+            }
+            input_report_key(gpio_input_device, controller_map.keymap[i], 1);
+            sync = true;
+        }
+    }
+    if (sync) {
+        controller_sync(&live_state);
+    }
+    turbo_mask = mask;
+    spin_unlock_irqrestore(&turbo_lock, flags);
+    return count;
+}
+static DEVICE_ATTR_RW(turbo_buttons);
+
+static ssize_t turbo_rate_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%u\n", turbo_rate);
+}
+
+static ssize_t turbo_rate_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int rate;
+    int err;
+
+    err = kstrtouint(buf, 0, &rate);
+    if (err) {
+        return err;
+    }
+    if (rate == 0 || rate > TURBO_MAX_RATE) {
+        return -EINVAL;
+    }
+    turbo_rate = rate;
+    return count;
+}
+static DEVICE_ATTR_RW(turbo_rate);
+
+static ssize_t turbo_duty_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%u\n", turbo_duty);
+}
+
+static ssize_t turbo_duty_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    unsigned int duty;
+    int err;
+
+    err = kstrtouint(buf, 0, &duty);
+    if (err) {
+        return err;
+    }
+    if (duty == 0 || duty >= 100) {
+        return -EINVAL;
+    }
+    turbo_duty = duty;
+    return count;
+}
+static DEVICE_ATTR_RW(turbo_duty);
+
+static ssize_t probe_time_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%lld\n", probe_time_us);
+}
+static DEVICE_ATTR_RO(probe_time_us);
+
+static ssize_t resume_count_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%lu\n", resume_count);
+}
+static DEVICE_ATTR_RO(resume_count);
+
+// Time from resume entry to the resync frame, last and worst
+static ssize_t resume_latency_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%lld %lld\n", resume_latency_us, resume_latency_max_us);
+}
+static DEVICE_ATTR_RO(resume_latency_us);
+
+static struct attribute *controller_attrs[] = {
+    &dev_attr_adc_chip.attr,
+    &dev_attr_adc_sample_rate.attr,
+    &dev_attr_adc_conversions.attr,
+    &dev_attr_adc_verified.attr,
+    &dev_attr_adc_mismatches.attr,
+    &dev_attr_adc_mismatch_ppm.attr,
+    &dev_attr_adc_read_errors.attr,
+    &dev_attr_dpad_suppressed.attr,
+    &dev_attr_turbo_buttons.attr,
+    &dev_attr_turbo_rate.attr,
+    &dev_attr_turbo_duty.attr,
+    &dev_attr_probe_time_us.attr,
+    &dev_attr_resume_count.attr,
+    &dev_attr_resume_latency_us.attr,
+    NULL
+};
+
+static const struct attribute_group controller_attr_group = {
+    .attrs = controller_attrs
+};
+
+// Sums count consecutive counters at offset into struct controller_stats over
+// all CPUs, one space separated value per button or axis
+static ssize_t controller_stats_show(char *buf, size_t offset, int count) {
+    const unsigned long *counters;
+    unsigned long sum;
+    ssize_t len = 0;
+    int cpu, n;
+
+    for (n = 0; n < count; n++) {
+        sum = 0;
+        for_each_possible_cpu(cpu) {
+            counters = (const void *)per_cpu_ptr(controller_stats, cpu) + offset;
+            sum += counters[n];
+        }
+        len += sprintf(buf + len, n ? " %lu" : "%lu", sum);
+    }
+    return len + sprintf(buf + len, "\n");
+}
+
+#define CONTROLLER_STATS_ATTR(field, count) \
+    static ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *buf) { \
+        return controller_stats_show(buf, offsetof(struct controller_stats, field), count); \
+    } \
+    static DEVICE_ATTR_RO(field)
+
+// Buttons in button_pins order, axes in sample order (X, Y, then aux)
+CONTROLLER_STATS_ATTR(button_edges, BUTTON_COUNT);
+CONTROLLER_STATS_ATTR(button_debounce_rejects, BUTTON_COUNT);
+CONTROLLER_STATS_ATTR(button_presses, BUTTON_COUNT);
+CONTROLLER_STATS_ATTR(axis_conversions, adc_sample_count_channels);
+CONTROLLER_STATS_ATTR(axis_mismatches, adc_sample_count_channels);
+CONTROLLER_STATS_ATTR(axis_out_of_range, adc_sample_count_channels);
+CONTROLLER_STATS_ATTR(polls, 1);
+CONTROLLER_STATS_ATTR(polls_skipped, 1);
+CONTROLLER_STATS_ATTR(events, 1);
+CONTROLLER_STATS_ATTR(syncs, 1);
+
+static struct attribute *controller_health_attrs[] = {
+    &dev_attr_button_edges.attr,
+    &dev_attr_button_debounce_rejects.attr,
+    &dev_attr_button_presses.attr,
+    &dev_attr_axis_conversions.attr,
+    &dev_attr_axis_mismatches.attr,
+    &dev_attr_axis_out_of_range.attr,
+    &dev_attr_polls.attr,
+    &dev_attr_polls_skipped.attr,
+    &dev_attr_events.attr,
+    &dev_attr_syncs.attr,
+    NULL
+};
+
+static const struct attribute_group controller_health_group = {
+    .name = "health",
+    .attrs = controller_health_attrs
+};
+
+static const struct attribute_group *controller_attr_groups[] = {
+    &controller_attr_group,
+    &controller_health_group,
+    NULL
+};
+
+static void turbo_timer_cancel(void *data) {
+    hrtimer_cancel(&turbo_timer);
+}
+
+static void joystick_spi_unregister(void *data) {
+    spi_unregister_device(data);
+}
+
+static int joystick_spi_register(struct device *dev) {
+    int err;
+
+    // Bus numbers are static board configuration, a missing one won't turn up
+    master = spi_busnum_to_master(controller_map.spi_bus);
+    if (master == NULL) {
+        dev_err(dev, "%s needs SPI bus %d, which doesn't exist\n", adc_chip->name, controller_map.spi_bus);
+        return -ENODEV;
+    }
+    joystick_spi_dev_info.bus_num = controller_map.spi_bus;
+    joystick_spi_dev_info.chip_select = controller_map.spi_chip_select;
+    joystick_spi_dev_info.max_speed_hz = adc_spi_hz ? adc_spi_hz : adc_chip->max_speed_hz;
+    joystick_spi_dev = spi_new_device(master, &joystick_spi_dev_info);
+    spi_master_put(master);
+    if (joystick_spi_dev == NULL) {
+        return -ENODEV;
+    }
+    err = devm_add_action_or_reset(dev, joystick_spi_unregister, joystick_spi_dev);
+    if (err) {
+        return err;
+    }
+    joystick_spi_dev->bits_per_word = 8;
+    return spi_setup(joystick_spi_dev);
+}
+
+static int joystick_select_adc_chip(void) {
+    int n;
+
+    adc_chip = NULL;
+    for (n = 0; n < ARRAY_SIZE(adc_chips); n++) {
+        if (strcmp(adc_chip_name, adc_chips[n].name) == 0) {
+            adc_chip = &adc_chips[n];
+        }
+    }
+    if (adc_chip == NULL) {
+        pr_err("gpio_controller_driver: unknown adc_chip %s\n", adc_chip_name);
+        return -EINVAL;
+    }
+    if (adc_chip->read == NULL) {
+        adc_sample_count_channels = 0;
+        return adc_aux_count ? -EINVAL : 0;
+    }
+
+    adc_sample_channels[0] = adc_x_channel;
+    adc_sample_channels[1] = adc_y_channel;
+    for (n = 0; n < adc_aux_count; n++) {
+        adc_sample_channels[2 + n] = adc_aux_channels[n];
+    }
+    adc_sample_count_channels = 2 + adc_aux_count;
+    for (n = 0; n < adc_sample_count_channels; n++) {
+        if (adc_sample_channels[n] >= adc_chip->num_channels) {
+            pr_err("gpio_controller_driver: %s has no channel %u\n", adc_chip->name, adc_sample_channels[n]);
+            return -EINVAL;
+        }
+        adc_last_vals[n] = 1 << (adc_chip->resolution - 1);
+    }
+    return 0;
+}
+
+static void controller_map_copy_pins(unsigned int *pins, const u32 *values, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        pins[i] = values[i];
+    }
+}
+
+static int controller_map_copy_keys(const u32 *values, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (values[i] == KEY_RESERVED || values[i] > KEY_MAX) {
+            return -EINVAL;
+        }
+        controller_map.keymap[i] = values[i];
+    }
+    return 0;
+}
+
+// Absent is fine, but a property that is there has to be right
+static int controller_map_read_u32(struct device *dev, const char *name, u32 *value, bool *found) {
+    int err;
+
+    *found = false;
+    if (!device_property_present(dev, name)) {
+        return 0;
+    }
+    err = device_property_read_u32(dev, name, value);
+    if (err) {
+        dev_err(dev, "%s is not a u32\n", name);
+        return err;
+    }
+    *found = true;
+    return 0;
+}
+
+// Device properties (device tree or software nodes) override the defaults
+// and module parameters override both
+static int controller_map_load(struct device *dev) {
+    u32 values[KEYMAP_SIZE];
+    u32 value;
+    bool found;
+    int err;
+
+    if (device_property_present(dev, "linux,keycodes")) {
+        err = device_property_read_u32_array(dev, "linux,keycodes", NULL, 0);
+        if (err != KEYMAP_SIZE) {
+            dev_err(dev, "linux,keycodes needs %d entries\n", KEYMAP_SIZE);
+            return err < 0 ? err : -EINVAL;
+        }
+        err = device_property_read_u32_array(dev, "linux,keycodes", values, KEYMAP_SIZE);
+        if (err == 0) {
+            err = controller_map_copy_keys(values, KEYMAP_SIZE);
+        }
+        if (err) {
+            dev_err(dev, "invalid linux,keycodes\n");
+            return err;
+        }
+    }
+    err = controller_map_read_u32(dev, "retropie,spi-bus", &value, &found);
+    if (err) {
+        return err;
+    }
+    if (found) {
+        controller_map.spi_bus = value;
+    }
+    err = controller_map_read_u32(dev, "retropie,spi-chip-select", &value, &found);
+    if (err) {
+        return err;
+    }
+    if (found) {
+        controller_map.spi_chip_select = value;
+    }
+
+    controller_map_copy_pins(controller_map.button_pins, param_button_pins, param_button_pins_count);
+    controller_map_copy_pins(controller_map.joystick_pins, param_joystick_pins, param_joystick_pins_count);
+    err = controller_map_copy_keys(param_keymap, param_keymap_count);
+    if (err) {
+        return err;
+    }
+    if (param_spi_bus >= 0) {
+        controller_map.spi_bus = param_spi_bus;
+    }
+    if (param_spi_chip_select >= 0) {
+        controller_map.spi_chip_select = param_spi_chip_select;
+    }
+    return 0;
+}
+
+static const enum gpiod_flags button_gpio_flags[BUTTON_COUNT] = {
+    [0 ... BUTTON_COUNT - 1] = GPIOD_IN
+};
+
+static const enum gpiod_flags joystick_gpio_flags[ADC_LINE_COUNT] = {
+    [ADC_LINE_CS] = GPIOD_OUT_HIGH,
+    [ADC_LINE_CLK] = GPIOD_OUT_LOW,
+    [ADC_LINE_DOI] = GPIOD_IN
+};
+
+static const char *const joystick_gpio_labels[ADC_LINE_COUNT] = {
+    [ADC_LINE_CS] = "joystick_cs",
+    [ADC_LINE_CLK] = "joystick_clk",
+    [ADC_LINE_DOI] = "joystick_doi"
+};
+
+// Takes count lines from <con_id>-gpios in the firmware node, in order. Without
+// that property, or when module parameters name pins, the global GPIO numbers
+// in pins are requested instead. Firmware lines should be GPIO_ACTIVE_HIGH:
+// the ADC0832 waveform is written as wire levels.
+static int controller_get_gpios(struct device *dev, const char *con_id, const unsigned int *pins, bool use_pins,
+                                const enum gpiod_flags *flags, const char *const *labels,
+                                struct gpio_desc **descs, int count) {
+    const char *label;
+    int found = 0;
+    int err, i;
+
+    if (!use_pins) {
+        found = gpiod_count(dev, con_id);
+        if (found == -ENOENT) {
+            found = 0;
+        } else if (found >= 0 && found != count) {
+            dev_err(dev, "%s-gpios needs %d entries, has %d\n", con_id, count, found);
+            return -EINVAL;
+        } else if (found < 0) {
+            return found;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (found) {
+            descs[i] = devm_gpiod_get_index(dev, con_id, i, flags[i]);
+            if (IS_ERR(descs[i])) {
+                return PTR_ERR(descs[i]);
+            }
+            continue;
+        }
+        label = labels ? labels[i] : devm_kasprintf(dev, GFP_KERNEL, "GPIO_%02u", pins[i]);
+        if (label == NULL) {
+            return -ENOMEM;
+        }
+        err = devm_gpio_request(dev, pins[i], label);
+        if (err) {
+            return err;
+        }
+        descs[i] = gpio_to_desc(pins[i]);
+        if (flags[i] == GPIOD_IN) {
+            err = gpiod_direction_input(descs[i]);
         } else {
-            left_key_val = 0;
-        }
-        input_report_key(gpio_input_device, LEFT_KEY, left_key_val);
-        input_sync(gpio_input_device);
-        input_report_key(gpio_input_device, RIGHT_KEY, right_key_val);
-        input_sync(gpio_input_device);
-        input_report_key(gpio_input_device, DOWN_KEY, down_key_val);
-        input_sync(gpio_input_device);
-        input_report_key(gpio_input_device, UP_KEY, up_key_val);
-        input_sync(gpio_input_device);
-    }
-}
-
-static void unallocate_all(void) {
-    if (y_irq_set) {free_irq(y_irq_number, NULL);}
-    if (x_irq_set) {free_irq(x_irq_number, NULL);}
-    if (b_irq_set) {free_irq(b_irq_number, NULL);}
-    if (a_irq_set) {free_irq(a_irq_number, NULL);}
-    if (select_irq_set) {free_irq(select_irq_number, NULL);}
-    if (start_irq_set) {free_irq(start_irq_number, NULL);}
-    if (right_shoulder_irq_set) {free_irq(right_shoulder_irq_number, NULL);}
-    if (left_shoulder_irq_set) {free_irq(left_shoulder_irq_number, NULL);}
-
-    if (joystick_doi_pin_requested) {gpio_free(JOYSTICK_DOI_PIN);}
-    if (joystick_clk_pin_requested) {gpio_free(JOYSTICK_CLK_PIN);}
-    if (joystick_cs_pin_requested) {gpio_free(JOYSTICK_CS_PIN);}
-    if (y_pin_requested) {gpio_free(Y_PIN);}
-    if (x_pin_requested) {gpio_free(X_PIN);}
-    if (b_pin_requested) {gpio_free(B_PIN);}
-    if (a_pin_requested) {gpio_free(A_PIN);}
-    if (select_pin_requested) {gpio_free(SELECT_PIN);}
-    if (start_pin_requested) {gpio_free(START_PIN);}
-    if (right_shoulder_pin_requested) {gpio_free(RIGHT_SHOULDER_PIN);}
-    if (left_shoulder_pin_requested) {gpio_free(LEFT_SHOULDER_PIN);}
-
-    if (spi_device_registered) {spi_unregister_device(joystick_spi_dev);}
-    if (gpio_device_registered) {
-        input_unregister_polled_device(gpio_polling_device);
-    } else if (gpio_device_allocated) {
-        input_free_polled_device(gpio_polling_device);
+            err = gpiod_direction_output(descs[i], flags[i] == GPIOD_OUT_HIGH);
+        }
+        if (err) {
+            return err;
+        }
     }
+    return 0;
+}
+
+// The driver can be unbound and bound again without reloading the module, and
+// a new device must not inherit the old one's keys, turbo phases, ADC history
+// or counters. turbo_mask and the module parameters are configuration and
+// stay.
+static void controller_reset_state(void) {
+    memset(&live_state, 0, sizeof(live_state));
+    live_state.turbo = true;
+    memset(turbo_state, 0, sizeof(turbo_state));
+    memset(adc_last_vals, 0, sizeof(adc_last_vals));
+    poll_last_ns = 0;
+    adc_busy_ns = 0;
+    adc_sample_count = 0;
+    adc_conversions = 0;
+    adc_verified = 0;
+    adc_mismatches = 0;
+    adc_read_errors = 0;
+    resume_count = 0;
+    resume_latency_us = 0;
+    resume_latency_max_us = 0;
 }
 
+// Everything is devm-managed, so a failed probe or an unbind releases it in
+// reverse order: debugfs and replay, IRQs and the turbo timer, then the input
+// device and its attributes are unregistered (stopping the poll) before the
+// SPI device and GPIOs it samples go away.
+static int gpio_controller_probe(struct platform_device *pdev) {
+    struct device *dev = &pdev->dev;
+    ktime_t start = ktime_get();
+    int err, i;
+
+    controller_reset_state();
+    err = joystick_select_adc_chip();
+    if (err) {
+        return err;
+    }
+    err = controller_map_load(dev);
+    if (err) {
+        return err;
+    }
+    controller_stats = devm_alloc_percpu(dev, struct controller_stats);
+    if (controller_stats == NULL) {
+        return -ENOMEM;
+    }
+
+    gpio_polling_device = devm_input_allocate_polled_device(dev);
+    if (gpio_polling_device == NULL) {
+        return -ENOMEM;
+    }
+    gpio_polling_device->poll = joystick_spi_poll;
+    gpio_polling_device->open = joystick_spi_open;
+    gpio_polling_device->poll_interval = 10;
+    gpio_input_device = gpio_polling_device->input;
+    live_state.input = gpio_input_device;
+    gpio_input_device->name = "gpio_input_device";
+    set_bit(EV_KEY, gpio_input_device->evbit);
+    set_bit(EV_REP, gpio_input_device->evbit);
+    gpio_input_device->keycode = controller_map.keymap;
+    gpio_input_device->keycodesize = sizeof(controller_map.keymap[0]);
+    gpio_input_device->keycodemax = KEYMAP_SIZE;
+    for (i = 0; i < KEYMAP_SIZE; i++) {
+        set_bit(controller_map.keymap[i], gpio_input_device->keybit);
+    }
+    for (i = 0; i < adc_aux_count; i++) {
+        input_set_abs_params(gpio_input_device, aux_abs_codes[i], 0, (1 << adc_chip->resolution) - 1, 0, 0);
+    }
+    // Created with the device, so they exist by the time udev hears of it
+    gpio_input_device->dev.groups = controller_attr_groups;
+
+    err = controller_get_gpios(dev, "button", controller_map.button_pins, param_button_pins_count > 0,
+                               button_gpio_flags, NULL, button_descs, BUTTON_COUNT);
+    if (err) {
+        return err;
+    }
+    if (adc_chip->bitbang) {
+        err = controller_get_gpios(dev, "joystick", controller_map.joystick_pins, param_joystick_pins_count > 0,
+                                   joystick_gpio_flags, joystick_gpio_labels, adc_descs, ADC_LINE_COUNT);
+        if (err) {
+            return err;
+        }
+    }
+
+    if (adc_chip->needs_spi) {
+        err = joystick_spi_register(dev);
+        if (err) {
+            return err;
+        }
+    }
+    if (adc_chip->init != NULL) {
+        err = adc_chip->init(dev);
+        if (err) {
+            return err;
+        }
+    }
+
+    err = input_register_polled_device(gpio_polling_device);
+    if (err) {
+        return err;
+    }
+
+    hrtimer_init(&turbo_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    turbo_timer.function = turbo_timer_fn;
+    err = devm_add_action_or_reset(dev, turbo_timer_cancel, NULL);
+    if (err) {
+        return err;
+    }
+
+    for (i = 0; i < BUTTON_COUNT; i++) {
+        err = gpiod_to_irq(button_descs[i]);
+        if (err < 0) {
+            return err;
+        }
+        button_irqs[i] = err;
+        err = devm_request_irq(dev, button_irqs[i], button_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "gpio_input_device", &button_descs[i]);
+        if (err) {
+            return err;
+        }
+    }
+
+    trace_debugfs_init();
+    err = devm_add_action_or_reset(dev, trace_debugfs_exit, NULL);
+    if (err) {
+        return err;
+    }
+
+    probe_time_us = ktime_us_delta(ktime_get(), start);
+    dev_info(dev, "probed %s backend in %lld us\n", adc_chip->name, probe_time_us);
+    return 0;
+}
+
+// Stops everything that can report: button IRQs, the turbo timer and the
+// poll. Edges while suspended are lost, which resume makes up for.
+static int __maybe_unused gpio_controller_suspend(struct device *dev) {
+    int i;
+
+    for (i = 0; i < BUTTON_COUNT; i++) {
+        disable_irq(button_irqs[i]);
+    }
+    hrtimer_cancel(&turbo_timer);
+    mutex_lock(&gpio_input_device->mutex);
+    cancel_delayed_work_sync(&gpio_polling_device->work);
+    mutex_unlock(&gpio_input_device->mutex);
+
+    // system_long_wq isn't frozen, so a replay has to be stopped by hand. A
+    // running one sees replay_abort and clears replay_busy itself; one that
+    // never started has to have it cleared here.
+    mutex_lock(&replay_lock);
+    replay_suspended = true;
+    replay_abort = true;
+    mutex_unlock(&replay_lock);
+    if (cancel_work_sync(&replay_work)) {
+        atomic_set(&replay_busy, 0);
+    }
+    return 0;
+}
+
+// Reports the current level of every button and a fresh stick sample as one
+// frame, with a single sync, before IRQs and polling restart, so anything that changed while
+// suspended is caught up immediately. The sample stands in for the first
+// poll, which is queued a normal interval later.
+static int __maybe_unused gpio_controller_resume(struct device *dev) {
+    ktime_t start = ktime_get();
+    struct button_state *b;
+    bool was_pressed, changed;
+    int level, i;
+
+    for (i = 0; i < BUTTON_COUNT; i++) {
+        level = gpiod_get_value(button_descs[i]);
+        b = &live_state.buttons[i];
+        was_pressed = b->val > 0;
+        // Only a level that changed while suspended is an edge worth replaying
+        if (core_button_resync(b, level)) {
+            trace_record(GPIO_TRACE_EDGE, i, level, ktime_to_ns(start));
+        }
+        changed = turbo_button_edge(i, level, b->val, was_pressed);
+        if (changed) {
+            controller_count_event(&live_state);
+        }
+    }
+    adc_sample_count++;
+    if (joystick_sample() == 0) {
+        controller_adc_frame(&live_state, adc_last_vals);
+    }
+    controller_sync(&live_state);
+
+    resume_latency_us = ktime_us_delta(ktime_get(), start);
+    resume_latency_max_us = max(resume_latency_max_us, resume_latency_us);
+    resume_count++;
+    poll_last_ns = 0;
+
+    for (i = 0; i < BUTTON_COUNT; i++) {
+        enable_irq(button_irqs[i]);
+    }
+    mutex_lock(&gpio_input_device->mutex);
+    if (gpio_input_device->users && gpio_polling_device->poll_interval > 0) {
+        queue_delayed_work(system_freezable_wq, &gpio_polling_device->work,
+                           msecs_to_jiffies(gpio_polling_device->poll_interval));
+    }
+    mutex_unlock(&gpio_input_device->mutex);
+
+    mutex_lock(&replay_lock);
+    replay_suspended = false;
+    mutex_unlock(&replay_lock);
+    return 0;
+}
+
+static SIMPLE_DEV_PM_OPS(gpio_controller_pm_ops, gpio_controller_suspend, gpio_controller_resume);
+
+static const struct of_device_id gpio_controller_of_match[] = {
+    { .compatible = "retropie,gpio-controller" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, gpio_controller_of_match);
+
+static struct platform_driver gpio_controller_driver = {
+    .probe = gpio_controller_probe,
+    .driver = {
+        .name = "gpio_controller_driver",
+        .of_match_table = gpio_controller_of_match,
+        .pm = &gpio_controller_pm_ops,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS
+    }
+};
+
+static struct platform_device *gpio_controller_device;
+
 static int __init gpio_controller_driver_init(void) {
-    gpio_polling_device = input_allocate_polled_device();
-    if (gpio_polling_device) {
-        gpio_device_allocated = true;
-
-        gpio_polling_device->poll = joystick_spi_poll;
-        gpio_polling_device->poll_interval = 10;
-        gpio_input_device = gpio_polling_device->input;
-        gpio_input_device->name = "gpio_input_device";
-        set_bit(EV_KEY, gpio_input_device->evbit);
-        set_bit(EV_REP, gpio_input_device->evbit);
-        set_bit(LEFT_SHOULDER_KEY, gpio_input_device->keybit);
-        set_bit(RIGHT_SHOULDER_KEY, gpio_input_device->keybit);
-        set_bit(START_KEY, gpio_input_device->keybit);
-        set_bit(SELECT_KEY, gpio_input_device->keybit);
-        set_bit(A_KEY, gpio_input_device->keybit);
-        set_bit(B_KEY, gpio_input_device->keybit);
-        set_bit(X_KEY, gpio_input_device->keybit);
-        set_bit(Y_KEY, gpio_input_device->keybit);
-        set_bit(LEFT_KEY, gpio_input_device->keybit);
-        set_bit(RIGHT_KEY, gpio_input_device->keybit);
-        set_bit(DOWN_KEY, gpio_input_device->keybit);
-        set_bit(UP_KEY, gpio_input_device->keybit);
-
-        if (input_register_polled_device(gpio_polling_device) == 0) {
-            char pin_code[8] = "GPIO_XX\0";
-            gpio_device_registered = true;
-
-            if (gpio_is_valid(LEFT_SHOULDER_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (LEFT_SHOULDER_PIN / 10);
-            pin_code[6] = '0' + (LEFT_SHOULDER_PIN % 10);
-            if (gpio_request(LEFT_SHOULDER_PIN, pin_code) < 0) {goto init_fail;}
-            left_shoulder_pin_requested = true;
-            gpio_direction_input(LEFT_SHOULDER_PIN);
-            left_shoulder_irq_number = gpio_to_irq(LEFT_SHOULDER_PIN);
-            if (request_irq(left_shoulder_irq_number, left_shoulder_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "gpio_input_device", NULL) < 0) {goto init_fail;}
-            left_shoulder_irq_set = true;
-
-            if (gpio_is_valid(RIGHT_SHOULDER_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (RIGHT_SHOULDER_PIN / 10);
-            pin_code[6] = '0' + (RIGHT_SHOULDER_PIN % 10);
-            if (gpio_request(RIGHT_SHOULDER_PIN, pin_code) < 0) {goto init_fail;}
-            right_shoulder_pin_requested = true;
-            gpio_direction_input(RIGHT_SHOULDER_PIN);
-            right_shoulder_irq_number = gpio_to_irq(RIGHT_SHOULDER_PIN);
-            if (request_irq(right_shoulder_irq_number, right_shoulder_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "gpio_input_device", NULL) < 0) {goto init_fail;}
-            right_shoulder_irq_set = true;
-
-            if (gpio_is_valid(START_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (START_PIN / 10);
-            pin_code[6] = '0' + (START_PIN % 10);
-            if (gpio_request(START_PIN, pin_code) < 0) {goto init_fail;}
-            start_pin_requested = true;
-            gpio_direction_input(START_PIN);
-            start_irq_number = gpio_to_irq(START_PIN);
-            if (request_irq(start_irq_number, start_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "gpio_input_device", NULL) < 0) {goto init_fail;}
-            start_irq_set = true;
-
-            if (gpio_is_valid(SELECT_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (SELECT_PIN / 10);
-            pin_code[6] = '0' + (SELECT_PIN % 10);
-            if (gpio_request(SELECT_PIN, pin_code) < 0) {goto init_fail;}
-            select_pin_requested = true;
-            gpio_direction_input(SELECT_PIN);
-            select_irq_number = gpio_to_irq(SELECT_PIN);
-            if (request_irq(select_irq_number, select_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "gpio_input_device", NULL) < 0) {goto init_fail;}
-            select_irq_set = true;
-
-            if (gpio_is_valid(A_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (A_PIN / 10);
-            pin_code[6] = '0' + (A_PIN % 10);
-            if (gpio_request(A_PIN, pin_code) < 0) {goto init_fail;}
-            a_pin_requested = true;
-            gpio_direction_input(A_PIN);
-            a_irq_number = gpio_to_irq(A_PIN);
-            if (request_irq(a_irq_number, a_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "gpio_input_device", NULL) < 0) {goto init_fail;}
-            a_irq_set = true;
-
-            if (gpio_is_valid(B_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (B_PIN / 10);
-            pin_code[6] = '0' + (B_PIN % 10);
-            if (gpio_request(B_PIN, pin_code) < 0) {goto init_fail;}
-            b_pin_requested = true;
-            gpio_direction_input(B_PIN);
-            b_irq_number = gpio_to_irq(B_PIN);
-            if (request_irq(b_irq_number, b_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "gpio_input_device", NULL) < 0) {goto init_fail;}
-            b_irq_set = true;
-
-            if (gpio_is_valid(X_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (X_PIN / 10);
-            pin_code[6] = '0' + (X_PIN % 10);
-            if (gpio_request(X_PIN, pin_code) < 0) {goto init_fail;}
-            x_pin_requested = true;
-            gpio_direction_input(X_PIN);
-            x_irq_number = gpio_to_irq(X_PIN);
-            if (request_irq(x_irq_number, x_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "gpio_input_device", NULL) < 0) {goto init_fail;}
-            x_irq_set = true;
-
-            if (gpio_is_valid(Y_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (Y_PIN / 10);
-            pin_code[6] = '0' + (Y_PIN % 10);
-            if (gpio_request(Y_PIN, pin_code) < 0) {goto init_fail;}
-            y_pin_requested = true;
-            gpio_direction_input(Y_PIN);
-            y_irq_number = gpio_to_irq(Y_PIN);
-            if (request_irq(y_irq_number, y_interrupt, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "gpio_input_device", NULL) < 0) {goto init_fail;}
-            y_irq_set = true;
-
-            if (gpio_is_valid(JOYSTICK_CS_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (JOYSTICK_CS_PIN / 10);
-            pin_code[6] = '0' + (JOYSTICK_CS_PIN % 10);
-            if (gpio_request(JOYSTICK_CS_PIN, pin_code) < 0) {goto init_fail;}
-            joystick_cs_pin_requested = true;
-            gpio_direction_output(JOYSTICK_CS_PIN, 1);
-
-            if (gpio_is_valid(JOYSTICK_CLK_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (JOYSTICK_CLK_PIN / 10);
-            pin_code[6] = '0' + (JOYSTICK_CLK_PIN % 10);
-            if (gpio_request(JOYSTICK_CLK_PIN, pin_code) < 0) {goto init_fail;}
-            joystick_clk_pin_requested = true;
-            gpio_direction_output(JOYSTICK_CLK_PIN, 0);
-
-            if (gpio_is_valid(JOYSTICK_DOI_PIN) == false) {goto init_fail;}
-            pin_code[5] = '0' + (JOYSTICK_DOI_PIN / 10);
-            pin_code[6] = '0' + (JOYSTICK_DOI_PIN % 10);
-            if (gpio_request(JOYSTICK_DOI_PIN, pin_code) < 0) {goto init_fail;}
-            joystick_doi_pin_requested = true;
-
-            master = spi_busnum_to_master(SPI_BUS_NUM);
-            if (master == NULL) {goto init_fail;}
-
-            joystick_spi_dev = spi_new_device(master, &joystick_spi_dev_info);
-            if (joystick_spi_dev == NULL) {goto init_fail;}
-            spi_device_registered = true;
-
-            joystick_spi_dev->bits_per_word = 8;
-            if (spi_setup(joystick_spi_dev)) {goto init_fail;}
+    struct device_node *node;
+    int err;
 
+    err = platform_driver_register(&gpio_controller_driver);
+    if (err) {
+        return err;
+    }
+    // An enabled device tree node gets its own platform device; a disabled
+    // one never will, so it falls back to the module parameters
+    for_each_matching_node(node, gpio_controller_of_match) {
+        if (of_device_is_available(node)) {
+            of_node_put(node);
             return 0;
         }
     }
-init_fail:
-    unallocate_all();
-    return -1;
+    gpio_controller_device = platform_device_register_simple("gpio_controller_driver", PLATFORM_DEVID_NONE, NULL, 0);
+    if (IS_ERR(gpio_controller_device)) {
+        platform_driver_unregister(&gpio_controller_driver);
+        return PTR_ERR(gpio_controller_device);
+    }
+    return 0;
 }
 
 static void __exit gpio_controller_driver_exit(void) {
-    unallocate_all();
+    if (gpio_controller_device) {
+        platform_device_unregister(gpio_controller_device);
+    }
+    platform_driver_unregister(&gpio_controller_driver);
 }
 
 module_init(gpio_controller_driver_init);
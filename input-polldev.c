@@ -286,13 +286,16 @@ EXPORT_SYMBOL(input_free_polled_device);
  * with input layer. The device should be allocated with call to
  * input_allocate_polled_device(). Callers should also set up poll()
  * method and set up capabilities (id, name, phys, bits) of the
- * corresponding input_dev structure.
+ * corresponding input_dev structure. Attribute groups the caller put in
+ * input->dev.groups are kept and created along with the polling
+ * attributes, before the device is announced.
  */
 int input_register_polled_device(struct input_polled_dev *dev)
 {
 	struct input_polled_devres *devres = NULL;
 	struct input_dev *input = dev->input;
-	int error;
+	const struct attribute_group **groups;
+	int error, n;
 
 	if (dev->devres_managed) {
 		devres = devres_alloc(devm_input_polldev_unregister,
@@ -314,7 +317,22 @@ int input_register_polled_device(struct input_polled_dev *dev)
 	input->open = input_open_polled_device;
 	input->close = input_close_polled_device;
 
-	input->dev.groups = input_polldev_attribute_groups;
+	if (input->dev.groups) {
+		for (n = 0; input->dev.groups[n]; n++)
+			;
+		/* Freed with the input device */
+		groups = devm_kcalloc(&input->dev, n + 2, sizeof(*groups),
+				      GFP_KERNEL);
+		if (!groups) {
+			devres_free(devres);
+			return -ENOMEM;
+		}
+		groups[0] = &input_polldev_attribute_group;
+		memcpy(&groups[1], input->dev.groups, n * sizeof(*groups));
+		input->dev.groups = groups;
+	} else {
+		input->dev.groups = input_polldev_attribute_groups;
+	}
 
 	error = input_register_device(input);
 	if (error) {
@@ -0,0 +1,683 @@
+// Userspace counterpart of gpio_controller_driver for systems that can't load
+// out-of-tree modules. Button edges come from the GPIO character device as
+// buffered, kernel-timestamped v2 line events, the stick from an ADC0832
+// bit-banged over the same interface or an MCP3x08 through spidev, and
+// everything is published through uinput. Debounce, the ADC protocol and the
+// d-pad emulation are the module's own, from controller_core.h.
+//
+// Pins are line offsets on --chip, not global GPIO numbers. On a Raspberry Pi
+// gpiochip0 offsets are the BCM numbers the module defaults to. Turbo and aux
+// axes stay kernel only.
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/gpio.h>
+#include <linux/spi/spidev.h>
+#include <linux/uinput.h>
+
+#include "../controller_core.h"
+
+#define CONSUMER "gpio_controller_uinput"
+#define EVENT_BUFFER_SIZE 64
+
+enum {
+    ADC_NONE = 0,
+    ADC_ADC0832,
+    ADC_MCP3008,
+    ADC_MCP3208
+};
+
+static unsigned int button_pins[BUTTON_COUNT] = {
+    LEFT_SHOULDER_PIN, RIGHT_SHOULDER_PIN, START_PIN, SELECT_PIN,
+    A_PIN, B_PIN, X_PIN, Y_PIN
+};
+static unsigned int joystick_pins[ADC_LINE_COUNT] = {
+    JOYSTICK_CS_PIN, JOYSTICK_CLK_PIN, JOYSTICK_DOI_PIN
+};
+static unsigned short keymap[KEYMAP_SIZE] = {
+    LEFT_SHOULDER_KEY, RIGHT_SHOULDER_KEY, START_KEY, SELECT_KEY,
+    A_KEY, B_KEY, X_KEY, Y_KEY,
+    UP_KEY, DOWN_KEY, LEFT_KEY, RIGHT_KEY
+};
+
+static const char *chip_path = "/dev/gpiochip0";
+static const char *spidev_path = "/dev/spidev1.0";
+static const char *device_name = "gpio_input_device";
+static int adc = ADC_ADC0832;
+static unsigned int adc_x_channel = PS2JOYSTICK_X_AXIS;
+static unsigned int adc_y_channel = PS2JOYSTICK_Y_AXIS;
+static unsigned int adc_clock_hz = ADC0832_CLOCK_HZ;
+static unsigned int adc_spi_hz;
+static unsigned int poll_ms = 10;
+static __u64 debounce_ns = DEBOUNCE_NS;
+static struct adc_verify_policy adc_verify = {
+    .fast_read = true,
+    .verify_interval = ADC_VERIFY_INTERVAL,
+    .jump_threshold = ADC_JUMP_THRESHOLD
+};
+static struct dpad_config dpad = {
+    .press_threshold = 127,
+    .release_threshold = 96,
+    .radial = false,
+    .angle_hysteresis = 8
+};
+
+static struct button_state buttons[BUTTON_COUNT];
+static struct dpad_state dpad_state;
+static int uinput_fd = -1;
+static int adc_fd = -1;
+static int adc_doi_input;
+static unsigned long adc_samples;
+static unsigned short adc_last[2];
+static unsigned long adc_mismatches;
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static __u64 now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int parse_list(const char *arg, unsigned int *values, int count) {
+    char *end;
+    int n;
+
+    for (n = 0; n < count; n++) {
+        values[n] = strtoul(arg, &end, 0);
+        if (end == arg || (n < count - 1 && *end != ',') || (n == count - 1 && *end != '\0')) {
+            return -1;
+        }
+        arg = end + 1;
+    }
+    return 0;
+}
+
+static void emit(unsigned short type, unsigned short code, int value) {
+    struct input_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    if (write(uinput_fd, &ev, sizeof(ev)) != sizeof(ev)) {
+        perror("uinput write");
+    }
+}
+
+static int uinput_open(void) {
+    struct uinput_setup setup;
+    int n;
+
+    uinput_fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+    if (uinput_fd < 0) {
+        perror("/dev/uinput");
+        return -1;
+    }
+    if (ioctl(uinput_fd, UI_SET_EVBIT, EV_KEY) < 0 || ioctl(uinput_fd, UI_SET_EVBIT, EV_REP) < 0) {
+        perror("uinput event bits");
+        return -1;
+    }
+    for (n = 0; n < KEYMAP_SIZE; n++) {
+        if (ioctl(uinput_fd, UI_SET_KEYBIT, keymap[n]) < 0) {
+            fprintf(stderr, "uinput key %u: %s\n", keymap[n], strerror(errno));
+            return -1;
+        }
+    }
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_HOST;
+    snprintf(setup.name, sizeof(setup.name), "%s", device_name);
+    if (ioctl(uinput_fd, UI_DEV_SETUP, &setup) < 0 || ioctl(uinput_fd, UI_DEV_CREATE) < 0) {
+        perror("uinput setup");
+        return -1;
+    }
+    return 0;
+}
+
+// One request for all buttons, both edges, with a kernel side buffer so a
+// burst of bounces doesn't drop the edge that matters
+static int buttons_open(int chip_fd) {
+    struct gpio_v2_line_request req;
+    int n;
+
+    memset(&req, 0, sizeof(req));
+    for (n = 0; n < BUTTON_COUNT; n++) {
+        req.offsets[n] = button_pins[n];
+    }
+    req.num_lines = BUTTON_COUNT;
+    req.event_buffer_size = EVENT_BUFFER_SIZE;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    snprintf(req.consumer, sizeof(req.consumer), CONSUMER);
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        perror("button line request");
+        return -1;
+    }
+    return req.fd;
+}
+
+// Same rules as controller_button_edge(), from controller_core.h: the first
+// edge after a quiet debounce window is taken, using the timestamp the kernel
+// took in its IRQ handler rather than when we got around to reading it. Like
+// the module's IRQ handler, the key follows the line level read after the
+// edge, not the edge direction.
+static void buttons_handle(int fd) {
+    struct gpio_v2_line_event events[EVENT_BUFFER_SIZE];
+    struct gpio_v2_line_values values;
+    ssize_t len;
+    size_t n;
+    int b, synced = 0;
+
+    len = read(fd, events, sizeof(events));
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("button events");
+        }
+        return;
+    }
+    values.mask = (1 << BUTTON_COUNT) - 1;
+    if (ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+        perror("button values");
+        return;
+    }
+    for (n = 0; n < len / sizeof(events[0]); n++) {
+        for (b = 0; b < BUTTON_COUNT && button_pins[b] != events[n].offset; b++) {
+        }
+        if (b == BUTTON_COUNT) {
+            continue;
+        }
+        if (core_button_edge(&buttons[b], !!(values.bits & (1 << b)), events[n].timestamp_ns, debounce_ns) < 0) {
+            continue;
+        }
+        emit(EV_KEY, keymap[b], buttons[b].val);
+        synced = 1;
+    }
+    if (synced) {
+        emit(EV_SYN, SYN_REPORT, 0);
+    }
+}
+
+// Reports the current levels, as the module does on probe and resume
+static void buttons_sync(int fd) {
+    struct gpio_v2_line_values values;
+    int b;
+
+    values.mask = (1 << BUTTON_COUNT) - 1;
+    if (ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+        perror("button values");
+        return;
+    }
+    for (b = 0; b < BUTTON_COUNT; b++) {
+        core_button_resync(&buttons[b], !!(values.bits & (1 << b)));
+        emit(EV_KEY, keymap[b], buttons[b].val);
+    }
+    emit(EV_SYN, SYN_REPORT, 0);
+}
+
+// ADC0832 over the character device: CS, CLK and DOI are requested in
+// ADC_LINE_* order, so a waveform step's lines byte is the value bitmap
+static int adc0832_open(int chip_fd) {
+    struct gpio_v2_line_request req;
+    int n;
+
+    memset(&req, 0, sizeof(req));
+    for (n = 0; n < ADC_LINE_COUNT; n++) {
+        req.offsets[n] = joystick_pins[n];
+    }
+    req.num_lines = ADC_LINE_COUNT;
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    req.config.num_attrs = 1;
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[0].attr.values = 1 << ADC_LINE_CS;
+    req.config.attrs[0].mask = (1 << ADC_LINE_COUNT) - 1;
+    snprintf(req.consumer, sizeof(req.consumer), CONSUMER);
+    if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        perror("joystick line request");
+        return -1;
+    }
+    return req.fd;
+}
+
+static int adc0832_doi_direction(unsigned char lines, int input) {
+    struct gpio_v2_line_config config;
+
+    if (adc_doi_input == input) {
+        return 0;
+    }
+    memset(&config, 0, sizeof(config));
+    config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    config.attrs[0].attr.values = lines;
+    config.attrs[0].mask = (1 << ADC_LINE_COUNT) - 1;
+    config.num_attrs = 1;
+    if (input) {
+        config.attrs[1].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+        config.attrs[1].attr.flags = GPIO_V2_LINE_FLAG_INPUT;
+        config.attrs[1].mask = 1 << ADC_LINE_DOI;
+        config.num_attrs = 2;
+    }
+    if (ioctl(adc_fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0) {
+        return -errno;
+    }
+    adc_doi_input = input;
+    return 0;
+}
+
+static void adc0832_wait(__u64 deadline) {
+    while (now_ns() < deadline) {
+    }
+}
+
+static int adc0832_read(unsigned char channel, bool verify, unsigned short *value) {
+    struct adc_wave_step wave[ADC0832_WAVE_MAX];
+    struct gpio_v2_line_values values;
+    unsigned char msb_first = 0, lsb_first = 0;
+    __u64 half_period = 500000000ull / adc_clock_hz;
+    __u64 deadline = now_ns();
+    int len, n, err;
+
+    len = adc0832_build_waveform(wave, channel, verify);
+    err = adc0832_doi_direction(1 << ADC_LINE_CS, 0);
+    if (err) {
+        return err;
+    }
+    for (n = 0; n < len; n++) {
+        if (wave[n].flags & ADC_WAVE_RELEASE_DOI) {
+            err = adc0832_doi_direction(wave[n].lines, 1);
+            if (err) {
+                return err;
+            }
+        }
+        values.bits = wave[n].lines;
+        values.mask = adc_doi_input ? (1 << ADC_LINE_CS) | (1 << ADC_LINE_CLK) : (1 << ADC_LINE_COUNT) - 1;
+        if (ioctl(adc_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
+            return -errno;
+        }
+        deadline += half_period;
+        adc0832_wait(deadline);
+        if (wave[n].flags & (ADC_WAVE_SAMPLE_MSB | ADC_WAVE_SAMPLE_LSB)) {
+            values.mask = 1 << ADC_LINE_DOI;
+            if (ioctl(adc_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+                return -errno;
+            }
+            adc0832_sample(wave[n].flags, !!(values.bits & (1 << ADC_LINE_DOI)), &msb_first, &lsb_first);
+        }
+    }
+    if (verify && !adc0832_frame_ok(msb_first, lsb_first)) {
+        return -EIO;
+    }
+    *value = msb_first;
+    return 0;
+}
+
+static int mcp3x08_open(void) {
+    unsigned char mode = SPI_MODE_0, bits = 8;
+    __u32 speed = adc_spi_hz ? adc_spi_hz : (adc == ADC_MCP3008 ? MCP3008_SPI_HZ : MCP3208_SPI_HZ);
+    int fd;
+
+    fd = open(spidev_path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror(spidev_path);
+        return -1;
+    }
+    if (ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0 || ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+        perror("spidev setup");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Both conversions in one SPI_IOC_MESSAGE, CS toggled between them
+static int mcp3x08_read(unsigned short *x, unsigned short *y) {
+    unsigned char resolution = adc == ADC_MCP3008 ? 10 : 12;
+    unsigned char tx[2][MCP3X08_FRAME_LEN], rx[2][MCP3X08_FRAME_LEN];
+    struct spi_ioc_transfer xfer[2];
+    int n;
+
+    memset(xfer, 0, sizeof(xfer));
+    mcp3x08_command(adc_x_channel, resolution, tx[0]);
+    mcp3x08_command(adc_y_channel, resolution, tx[1]);
+    for (n = 0; n < 2; n++) {
+        xfer[n].tx_buf = (unsigned long)tx[n];
+        xfer[n].rx_buf = (unsigned long)rx[n];
+        xfer[n].len = MCP3X08_FRAME_LEN;
+    }
+    xfer[0].cs_change = 1;
+    if (ioctl(adc_fd, SPI_IOC_MESSAGE(2), xfer) < 0) {
+        return -errno;
+    }
+    *x = mcp3x08_decode(rx[0], resolution);
+    *y = mcp3x08_decode(rx[1], resolution);
+    return 0;
+}
+
+static int adc0832_read_stick(bool verify, unsigned short *values) {
+    int err;
+
+    err = adc0832_read(adc_x_channel, verify, &values[0]);
+    if (err == 0) {
+        err = adc0832_read(adc_y_channel, verify, &values[1]);
+    }
+    return err;
+}
+
+// Same verify policy as joystick_sample() in the module
+static void joystick_poll(void) {
+    unsigned short values[2];
+    unsigned char resolution = 8;
+    unsigned char keys;
+    int up, right, err;
+    bool verify;
+
+    adc_samples++;
+    if (adc == ADC_ADC0832) {
+        verify = adc_verify_due(&adc_verify, adc_samples);
+        err = adc0832_read_stick(verify, values);
+        if (err == 0 && !verify && adc_sample_jumped(&adc_verify, resolution, values, adc_last, 2)) {
+            err = adc0832_read_stick(true, values);
+        }
+    } else {
+        resolution = adc == ADC_MCP3008 ? 10 : 12;
+        err = mcp3x08_read(&values[0], &values[1]);
+    }
+    if (err) {
+        adc_mismatches++;
+        return;
+    }
+    memcpy(adc_last, values, sizeof(adc_last));
+
+    dpad_position(values[0], values[1], resolution, &up, &right);
+    keys = dpad_update(&dpad, &dpad_state, up, right);
+    emit(EV_KEY, keymap[LEFT_KEYMAP], !!(keys & (1 << DPAD_LEFT)));
+    emit(EV_KEY, keymap[RIGHT_KEYMAP], !!(keys & (1 << DPAD_RIGHT)));
+    emit(EV_KEY, keymap[DOWN_KEYMAP], !!(keys & (1 << DPAD_DOWN)));
+    emit(EV_KEY, keymap[UP_KEYMAP], !!(keys & (1 << DPAD_UP)));
+    emit(EV_SYN, SYN_REPORT, 0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -c, --chip PATH              GPIO character device (%s)\n"
+            "  -a, --adc CHIP               adc0832, mcp3008, mcp3208 or none\n"
+            "  -s, --spidev PATH            spidev node for the mcp3x08 (%s)\n"
+            "  -b, --button-pins L,R,START,SELECT,A,B,X,Y\n"
+            "  -j, --joystick-pins CS,CLK,DOI\n"
+            "  -k, --keymap CODE,...        12 key codes, buttons then up,down,left,right\n"
+            "  -x, --adc-channels X,Y\n"
+            "      --adc-clock-hz HZ        ADC0832 bit-bang clock (%u)\n"
+            "      --adc-spi-hz HZ          mcp3x08 SPI clock\n"
+            "      --no-fast-read           verify every ADC0832 conversion\n"
+            "      --verify-interval N      verify every Nth fast ADC0832 sample (%u)\n"
+            "      --jump-threshold N       re-read with verify past this move (%u)\n"
+            "  -p, --poll-ms MS             stick poll interval (%u)\n"
+            "  -d, --debounce-us US         button debounce window (%llu)\n"
+            "      --press N --release N    d-pad thresholds (%u, %u)\n"
+            "      --radial                 8-way radial d-pad\n"
+            "      --angle-hysteresis DEG   radial sector hysteresis (%u)\n"
+            "  -n, --name NAME              input device name (%s)\n",
+            prog, chip_path, spidev_path, adc_clock_hz, adc_verify.verify_interval, adc_verify.jump_threshold, poll_ms,
+            (unsigned long long)(debounce_ns / 1000), dpad.press_threshold, dpad.release_threshold,
+            dpad.angle_hysteresis, device_name);
+}
+
+enum {
+    OPT_ADC_CLOCK_HZ = 256,
+    OPT_ADC_SPI_HZ,
+    OPT_NO_FAST_READ,
+    OPT_VERIFY_INTERVAL,
+    OPT_JUMP_THRESHOLD,
+    OPT_PRESS,
+    OPT_RELEASE,
+    OPT_RADIAL,
+    OPT_ANGLE_HYSTERESIS
+};
+
+static const struct option options[] = {
+    {"chip", required_argument, NULL, 'c'},
+    {"adc", required_argument, NULL, 'a'},
+    {"spidev", required_argument, NULL, 's'},
+    {"button-pins", required_argument, NULL, 'b'},
+    {"joystick-pins", required_argument, NULL, 'j'},
+    {"keymap", required_argument, NULL, 'k'},
+    {"adc-channels", required_argument, NULL, 'x'},
+    {"adc-clock-hz", required_argument, NULL, OPT_ADC_CLOCK_HZ},
+    {"adc-spi-hz", required_argument, NULL, OPT_ADC_SPI_HZ},
+    {"no-fast-read", no_argument, NULL, OPT_NO_FAST_READ},
+    {"verify-interval", required_argument, NULL, OPT_VERIFY_INTERVAL},
+    {"jump-threshold", required_argument, NULL, OPT_JUMP_THRESHOLD},
+    {"poll-ms", required_argument, NULL, 'p'},
+    {"debounce-us", required_argument, NULL, 'd'},
+    {"press", required_argument, NULL, OPT_PRESS},
+    {"release", required_argument, NULL, OPT_RELEASE},
+    {"radial", no_argument, NULL, OPT_RADIAL},
+    {"angle-hysteresis", required_argument, NULL, OPT_ANGLE_HYSTERESIS},
+    {"name", required_argument, NULL, 'n'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static int parse_options(int argc, char **argv) {
+    unsigned int keys[KEYMAP_SIZE], channels[2];
+    int opt, n;
+
+    while ((opt = getopt_long(argc, argv, "c:a:s:b:j:k:x:p:d:n:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            chip_path = optarg;
+            break;
+        case 'a':
+            if (strcmp(optarg, "none") == 0) {
+                adc = ADC_NONE;
+            } else if (strcmp(optarg, "adc0832") == 0) {
+                adc = ADC_ADC0832;
+            } else if (strcmp(optarg, "mcp3008") == 0) {
+                adc = ADC_MCP3008;
+            } else if (strcmp(optarg, "mcp3208") == 0) {
+                adc = ADC_MCP3208;
+            } else {
+                fprintf(stderr, "unknown adc %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            spidev_path = optarg;
+            break;
+        case 'b':
+            if (parse_list(optarg, button_pins, BUTTON_COUNT)) {
+                fprintf(stderr, "--button-pins takes %d offsets\n", BUTTON_COUNT);
+                return -1;
+            }
+            break;
+        case 'j':
+            if (parse_list(optarg, joystick_pins, ADC_LINE_COUNT)) {
+                fprintf(stderr, "--joystick-pins takes %d offsets\n", ADC_LINE_COUNT);
+                return -1;
+            }
+            break;
+        case 'k':
+            if (parse_list(optarg, keys, KEYMAP_SIZE)) {
+                fprintf(stderr, "--keymap takes %d key codes\n", KEYMAP_SIZE);
+                return -1;
+            }
+            for (n = 0; n < KEYMAP_SIZE; n++) {
+                if (keys[n] == KEY_RESERVED || keys[n] > KEY_MAX) {
+                    fprintf(stderr, "invalid key code %u\n", keys[n]);
+                    return -1;
+                }
+                keymap[n] = keys[n];
+            }
+            break;
+        case 'x':
+            if (parse_list(optarg, channels, 2)) {
+                fprintf(stderr, "--adc-channels takes X,Y\n");
+                return -1;
+            }
+            adc_x_channel = channels[0];
+            adc_y_channel = channels[1];
+            break;
+        case OPT_ADC_CLOCK_HZ:
+            adc_clock_hz = strtoul(optarg, NULL, 0);
+            if (adc_clock_hz < ADC0832_MIN_CLOCK_HZ || adc_clock_hz > ADC0832_MAX_CLOCK_HZ) {
+                fprintf(stderr, "--adc-clock-hz must be %u..%u\n", ADC0832_MIN_CLOCK_HZ, ADC0832_MAX_CLOCK_HZ);
+                return -1;
+            }
+            break;
+        case OPT_ADC_SPI_HZ:
+            adc_spi_hz = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_NO_FAST_READ:
+            adc_verify.fast_read = false;
+            break;
+        case OPT_VERIFY_INTERVAL:
+            adc_verify.verify_interval = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_JUMP_THRESHOLD:
+            adc_verify.jump_threshold = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            poll_ms = strtoul(optarg, NULL, 0);
+            if (poll_ms == 0) {
+                poll_ms = 1;
+            }
+            break;
+        case 'd':
+            debounce_ns = strtoull(optarg, NULL, 0) * 1000;
+            break;
+        case OPT_PRESS:
+            dpad.press_threshold = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_RELEASE:
+            dpad.release_threshold = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_RADIAL:
+            dpad.radial = true;
+            break;
+        case OPT_ANGLE_HYSTERESIS:
+            dpad.angle_hysteresis = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            device_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (adc == ADC_ADC0832 && (adc_x_channel > 1 || adc_y_channel > 1)) {
+        fprintf(stderr, "adc0832 has channels 0 and 1\n");
+        return -1;
+    }
+    if ((adc == ADC_MCP3008 || adc == ADC_MCP3208) && (adc_x_channel > 7 || adc_y_channel > 7)) {
+        fprintf(stderr, "mcp3x08 has channels 0..7\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct itimerspec period;
+    struct pollfd fds[2];
+    struct sigaction sa;
+    int chip_fd, button_fd, timer_fd = -1;
+    int nfds = 1;
+    uint64_t expirations;
+
+    if (parse_options(argc, argv)) {
+        return 1;
+    }
+
+    chip_fd = open(chip_path, O_RDWR | O_CLOEXEC);
+    if (chip_fd < 0) {
+        perror(chip_path);
+        return 1;
+    }
+    button_fd = buttons_open(chip_fd);
+    if (button_fd < 0) {
+        return 1;
+    }
+    if (adc == ADC_ADC0832) {
+        adc_fd = adc0832_open(chip_fd);
+    } else if (adc != ADC_NONE) {
+        adc_fd = mcp3x08_open();
+    }
+    close(chip_fd);
+    if (adc != ADC_NONE && adc_fd < 0) {
+        return 1;
+    }
+    if (uinput_open()) {
+        return 1;
+    }
+
+    fds[0].fd = button_fd;
+    fds[0].events = POLLIN;
+    if (adc != ADC_NONE) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (timer_fd < 0) {
+            perror("timerfd");
+            return 1;
+        }
+        period.it_interval.tv_sec = poll_ms / 1000;
+        period.it_interval.tv_nsec = (poll_ms % 1000) * 1000000;
+        period.it_value = period.it_interval;
+        timerfd_settime(timer_fd, 0, &period, NULL);
+        fds[1].fd = timer_fd;
+        fds[1].events = POLLIN;
+        nfds = 2;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    buttons_sync(button_fd);
+    while (running) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            buttons_handle(button_fd);
+        }
+        if (nfds > 1 && (fds[1].revents & POLLIN)) {
+            if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                joystick_poll();
+            }
+        }
+    }
+
+    if (adc != ADC_NONE) {
+        fprintf(stderr, "%lu stick samples, %lu failed\n", adc_samples, adc_mismatches);
+    }
+    ioctl(uinput_fd, UI_DEV_DESTROY);
+    close(uinput_fd);
+    if (timer_fd >= 0) {
+        close(timer_fd);
+    }
+    if (adc_fd >= 0) {
+        close(adc_fd);
+    }
+    close(button_fd);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#!/bin/sh
+# Side-by-side button latency of the uinput daemon and the kernel module on a
+# gpio-sim chip. Run as root from the repository root after `make` and
+# `make userspace`. Needs configfs and the gpio-sim module; the module runs
+# with adc_chip=none as there is no SPI master behind the simulated chip.
+#
+# ITERATIONS and GAP_MS tune the run, GAP_MS must exceed the debounce window.
+set -e
+
+ITERATIONS=${ITERATIONS:-1000}
+GAP_MS=${GAP_MS:-50}
+LABEL=gpio_controller_bench
+CFG=/sys/kernel/config/gpio-sim/$LABEL
+# A button, line 4 on the simulated chip
+BUTTON=4
+KEY=46
+
+evdev_by_name() {
+    for dir in /sys/class/input/event*; do
+        if [ "$(cat "$dir/device/name")" = "$1" ]; then
+            echo "/dev/input/$(basename "$dir")"
+            return
+        fi
+    done
+}
+
+wait_evdev() {
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        node=$(evdev_by_name "$1")
+        if [ -n "$node" ]; then
+            echo "$node"
+            return
+        fi
+        sleep 0.2
+    done
+    echo "no input device named $1" >&2
+    exit 1
+}
+
+cleanup() {
+    [ -n "$DAEMON" ] && kill "$DAEMON" 2>/dev/null
+    rmmod gpio_controller_driver 2>/dev/null || true
+    if [ -d "$CFG" ]; then
+        echo 0 > "$CFG/live"
+        rmdir "$CFG/bank0" "$CFG"
+    fi
+}
+trap cleanup EXIT
+
+modprobe gpio-sim
+mkdir -p /sys/kernel/config
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+mkdir "$CFG" "$CFG/bank0"
+echo 8 > "$CFG/bank0/num_lines"
+echo $LABEL > "$CFG/bank0/label"
+echo 1 > "$CFG/live"
+CHIP=$(cat "$CFG/bank0/chip_name")
+PULL=/sys/devices/platform/$(cat "$CFG/dev_name")/$CHIP/sim_gpio$BUTTON/pull
+
+./userspace/gpio_controller_uinput --chip "/dev/$CHIP" --adc none --button-pins 0,1,2,3,4,5,6,7 \
+    --name gpio_input_device_uinput &
+DAEMON=$!
+EVDEV=$(wait_evdev gpio_input_device_uinput)
+./userspace/gpio_sim_latency "$EVDEV" "$PULL" $KEY "$ITERATIONS" "$GAP_MS" > /tmp/$LABEL.uinput
+kill "$DAEMON"
+wait "$DAEMON" || true
+DAEMON=
+
+# The module takes global GPIO numbers
+for dir in /sys/class/gpio/gpiochip*; do
+    if [ "$(cat "$dir/label")" = "$LABEL" ]; then
+        BASE=$(cat "$dir/base")
+    fi
+done
+if [ -z "$BASE" ]; then
+    echo "$LABEL not in /sys/class/gpio, is CONFIG_GPIO_SYSFS set?" >&2
+    exit 1
+fi
+PINS=$BASE
+for i in 1 2 3 4 5 6 7; do
+    PINS=$PINS,$((BASE + i))
+done
+lsmod | grep -q '^input_polldev' || insmod input-polldev.ko
+insmod gpio_controller_driver.ko adc_chip=none button_pins=$PINS
+EVDEV=$(wait_evdev gpio_input_device)
+./userspace/gpio_sim_latency "$EVDEV" "$PULL" $KEY "$ITERATIONS" "$GAP_MS" > /tmp/$LABEL.kernel
+rmmod gpio_controller_driver
+
+printf "%-10s %10s %10s\n" "" uinput kernel
+paste /tmp/$LABEL.uinput /tmp/$LABEL.kernel | while read -r name a _ b; do
+    printf "%-10s %10s %10s\n" "$name" "$a" "$b"
+done
@@ -0,0 +1,138 @@
+// Measures line-to-evdev latency on a gpio-sim chip: flips a simulated line
+// through its sysfs pull attribute and times how long the matching key event
+// takes to reach an evdev node. Works the same against the kernel module and
+// the uinput daemon, so the two can be compared on one machine.
+//
+// usage: gpio_sim_latency EVDEV PULL_ATTR KEYCODE [ITERATIONS] [GAP_MS]
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#define EVENT_TIMEOUT_MS 1000
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int set_pull(const char *path, int up) {
+    const char *value = up ? "pull-up" : "pull-down";
+    int fd, err = 0;
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (write(fd, value, strlen(value)) < 0) {
+        err = -errno;
+    }
+    close(fd);
+    return err;
+}
+
+// Waits for the key to reach the given value and returns the event time in
+// CLOCK_MONOTONIC ns, 0 on timeout
+static unsigned long long wait_key(int fd, unsigned short code, int value) {
+    struct input_event ev;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    unsigned long long deadline = now_ns() + EVENT_TIMEOUT_MS * 1000000ull;
+    unsigned long long now;
+
+    while ((now = now_ns()) < deadline) {
+        if (poll(&pfd, 1, (deadline - now) / 1000000 + 1) <= 0) {
+            continue;
+        }
+        while (read(fd, &ev, sizeof(ev)) == sizeof(ev)) {
+            if (ev.type == EV_KEY && ev.code == code && ev.value == value) {
+                return (unsigned long long)ev.input_event_sec * 1000000000ull + ev.input_event_usec * 1000ull;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned long long *samples, sum = 0, t0, t1;
+    unsigned int iterations = 1000, gap_ms = 50, count = 0, lost = 0, n;
+    unsigned short code;
+    int clock = CLOCK_MONOTONIC;
+    int fd, up;
+
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s EVDEV PULL_ATTR KEYCODE [ITERATIONS] [GAP_MS]\n", argv[0]);
+        return 1;
+    }
+    code = strtoul(argv[3], NULL, 0);
+    if (argc > 4) {
+        iterations = strtoul(argv[4], NULL, 0);
+    }
+    if (argc > 5) {
+        gap_ms = strtoul(argv[5], NULL, 0);
+    }
+
+    fd = open(argv[1], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    // Event timestamps on the same clock we take t0 from
+    if (ioctl(fd, EVIOCSCLOCKID, &clock) < 0) {
+        perror("EVIOCSCLOCKID");
+        return 1;
+    }
+    samples = calloc(iterations, sizeof(*samples));
+    if (samples == NULL) {
+        return 1;
+    }
+
+    // Start released, and give the debounce window time to pass
+    set_pull(argv[2], 0);
+    usleep(gap_ms * 1000);
+    while (read(fd, samples, sizeof(struct input_event)) > 0) {
+    }
+
+    for (n = 0; n < iterations; n++) {
+        up = !(n & 1);
+        t0 = now_ns();
+        if (set_pull(argv[2], up)) {
+            perror(argv[2]);
+            return 1;
+        }
+        t1 = wait_key(fd, code, up);
+        if (t1 == 0 || t1 < t0) {
+            lost++;
+        } else {
+            samples[count++] = t1 - t0;
+            sum += t1 - t0;
+        }
+        usleep(gap_ms * 1000);
+    }
+    set_pull(argv[2], 0);
+
+    if (count == 0) {
+        fprintf(stderr, "no events seen on %s\n", argv[1]);
+        return 1;
+    }
+    qsort(samples, count, sizeof(*samples), cmp_ull);
+    printf("samples %u\nlost %u\nmin_us %llu\nmean_us %llu\np50_us %llu\np99_us %llu\nmax_us %llu\n",
+           count, lost, samples[0] / 1000, sum / count / 1000, samples[count / 2] / 1000,
+           samples[count * 99 / 100] / 1000, samples[count - 1] / 1000);
+    free(samples);
+    close(fd);
+    return 0;
+}